@@ -2,59 +2,94 @@
 
 #include <ctype.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "console.h"
+#include "logger.h"
+#include "perf.h"
 #include "report.h"
 #include "web.h"
 
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "harness.h"
+
 /* Some global values */
 int simulation = 0;
 int show_entropy = 0;
 static cmd_element_t *cmd_list = NULL;
 static param_element_t *param_list = NULL;
+
+/* Open addressing hash table from names to commands or parameters, beside
+ * the sorted lists which help and completion walk.
+ */
+typedef struct {
+    const char *name;
+    void *element;
+} name_slot_t;
+
+typedef struct {
+    name_slot_t *slots;
+    size_t size; /* Power of two, or 0 before the first name */
+    size_t count;
+} name_index_t;
+
+static name_index_t cmd_index, param_index;
 static bool block_flag = false;
 static bool prompt_flag = true;
 
 /* Am I timing a command that has the console blocked? */
 static bool block_timing = false;
 
-/* Time of day */
-static double first_time, last_time;
+/* Time since startup */
+static uint64_t first_time, last_time;
+
+/* Where the time of every command line goes, if anywhere */
+static FILE *timing_log = NULL;
 
 /* Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
+ * Regular files are mapped whole instead, and lines are handed out in place.
  */
 
 #define RIO_BUFSIZE 8192
 
 typedef struct __rio {
-    int fd;                /* File descriptor */
-    int count;             /* Unread bytes in internal buffer */
-    char *bufptr;          /* Next unread byte in internal buffer */
-    char buf[RIO_BUFSIZE]; /* Internal buffer */
-    struct __rio *prev;    /* Next element in stack */
+    int fd;             /* File descriptor */
+    size_t count;       /* Unread bytes in buffer */
+    char *bufptr;       /* Next unread byte in buffer */
+    char *buf;          /* Internal buffer, or the mapped file */
+    size_t size;        /* Bytes of buf, grown for lines longer than it */
+    bool mapped;        /* Whether buf maps the file */
+    struct __rio *prev; /* Next element in stack */
 } rio_t;
 
 static rio_t *buf_stack;
-static char linebuf[RIO_BUFSIZE];
 
 /* Maximum file descriptor */
 static int fd_max = 0;
 
 /* Parameters */
 static int err_limit = 5;
-static int err_cnt = 0;
+static atomic_int err_cnt = 0;
 static int echo = 0;
 
-static bool quit_flag = false;
+/* Command being executed, for diagnostics */
+static __thread int running_argc = 0;
+static __thread char **running_argv = NULL;
+
+/* Set by web workers too */
+static atomic_bool quit_flag = false;
 static char *prompt = "cmd> ";
 static bool has_infile = false;
 
@@ -65,6 +100,14 @@ static bool has_infile = false;
 static cmd_func_t quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
 
+/* Number of elements, for the per element counts of perf */
+static int (*size_helper)(void) = NULL;
+static bool (*session_helper)(const char *id) = NULL;
+static bool (*worker_helper)(void) = NULL;
+
+/* Threads running the commands of web sessions */
+static int web_workers = 0;
+
 static void init_in();
 
 static bool push_file(char *fname);
@@ -72,6 +115,66 @@ static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/* FNV-1a */
+static uint32_t hash_name(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static name_slot_t *index_slot(const name_index_t *index, const char *name)
+{
+    size_t mask = index->size - 1;
+    size_t i = hash_name(name) & mask;
+    while (index->slots[i].name && strcmp(index->slots[i].name, name))
+        i = (i + 1) & mask;
+    return &index->slots[i];
+}
+
+static void *index_find(const name_index_t *index, const char *name)
+{
+    return index->size ? index_slot(index, name)->element : NULL;
+}
+
+/* Map name to element, replacing any element of the same name */
+static void index_add(name_index_t *index, const char *name, void *element)
+{
+    /* Kept at most half full, so that probe sequences stay short */
+    if (2 * (index->count + 1) > index->size) {
+        name_index_t bigger = {
+            .size = index->size ? 2 * index->size : 64,
+            .count = index->count,
+        };
+        bigger.slots =
+            calloc_or_fail(bigger.size, sizeof(name_slot_t), "index_add");
+        for (size_t i = 0; i < index->size; i++) {
+            if (index->slots[i].name)
+                *index_slot(&bigger, index->slots[i].name) = index->slots[i];
+        }
+        if (index->size)
+            free_array(index->slots, index->size, sizeof(name_slot_t));
+        *index = bigger;
+    }
+
+    name_slot_t *slot = index_slot(index, name);
+    if (!slot->name)
+        index->count++;
+    slot->name = name;
+    slot->element = element;
+}
+
+static void index_clear(name_index_t *index)
+{
+    if (index->size)
+        free_array(index->slots, index->size, sizeof(name_slot_t));
+    index->slots = NULL;
+    index->size = index->count = 0;
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
 {
@@ -87,8 +190,26 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->operation = operation;
     cmd->summary = summary;
     cmd->param = param;
+    cmd->metrics = metrics_register(name);
+    cmd->elements = ELEMENTS_NONE;
+    cmd->console_only = false;
     cmd->next = next_cmd;
     *last_loc = cmd;
+    index_add(&cmd_index, name, cmd);
+}
+
+void set_cmd_elements(char *name, cmd_elements_t elements)
+{
+    cmd_element_t *cmd = index_find(&cmd_index, name);
+    if (cmd)
+        cmd->elements = elements;
+}
+
+void set_cmd_console_only(char *name)
+{
+    cmd_element_t *cmd = index_find(&cmd_index, name);
+    if (cmd)
+        cmd->console_only = true;
 }
 
 /* Add a new parameter */
@@ -109,53 +230,50 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     param->setter = setter;
     param->next = next_param;
     *last_loc = param;
+    index_add(&param_index, name, param);
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
-{
-    /* Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
+/* Reused by every command line, so that parsing one allocates nothing once
+ * the arena has grown to the longest line.
+ */
+static __thread char *arg_buf = NULL;
+static __thread char **arg_argv = NULL;
+static __thread size_t arg_cap = 0; /* Bytes of arg_buf */
 
-    char *src = line;
-    char *dst = buf;
-    bool skipping = true;
-    int c;
-    int argc = 0;
-    while ((c = *src++) != '\0') {
-        if (isspace(c)) {
-            if (!skipping) {
-                /* Hit end of word */
-                *dst++ = '\0';
-                skipping = true;
-            }
-        } else {
-            if (skipping) {
-                /* Hit start of new word */
-                argc++;
-                skipping = false;
-            }
-            *dst++ = c;
+/* Split a command line of len bytes into arguments, which stay valid until
+ * the next call. The line is copied first, as callers keep it, e.g. for the
+ * history, or it lies in the read-only mapping of a file.
+ */
+static char **parse_args(const char *line, size_t len, int *argcp)
+{
+    if (len + 1 > arg_cap) {
+        if (arg_cap) {
+            free_block(arg_buf, arg_cap);
+            free_array(arg_argv, arg_cap / 2 + 1, sizeof(char *));
         }
+        arg_cap = len + 1 > 2 * arg_cap ? len + 1 : 2 * arg_cap;
+        arg_buf = malloc_or_fail(arg_cap, "parse_args");
+        /* No more words than every other character */
+        arg_argv =
+            calloc_or_fail(arg_cap / 2 + 1, sizeof(char *), "parse_args");
     }
+    memcpy(arg_buf, line, len);
+    arg_buf[len] = '\0';
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
+    int argc = 0;
+    char *p = arg_buf;
+    while (*p) {
+        while (isspace((unsigned char) *p))
+            *p++ = '\0';
+        if (!*p)
+            break;
+        arg_argv[argc++] = p;
+        while (*p && !isspace((unsigned char) *p))
+            p++;
     }
 
-    free_block(buf, len + 1);
     *argcp = argc;
-    return argv;
+    return arg_argv;
 }
 
 static void record_error()
@@ -167,18 +285,76 @@ static void record_error()
     }
 }
 
+/* What a command did, from the counts taken before it ran */
+typedef struct {
+    uint64_t start;
+    size_t allocs, fails;
+    cmd_elements_t elements;
+    int size;
+} measure_t;
+
+static void measure_start(measure_t *m, cmd_elements_t elements)
+{
+    m->elements = size_helper ? elements : ELEMENTS_NONE;
+    get_alloc_counts(&m->allocs, &m->fails);
+    m->size = m->elements != ELEMENTS_NONE ? size_helper() : 0;
+    init_time(&m->start);
+}
+
+static void measure_end(measure_t *m, cmd_metrics_t *metrics, bool ok)
+{
+    metrics_sample_t sample = {.ns = delta_time(&m->start), .ok = ok};
+    int size = m->elements != ELEMENTS_NONE ? size_helper() : 0;
+    size_t allocs, fails;
+    get_alloc_counts(&allocs, &fails);
+    if (m->elements == ELEMENTS_CHANGED)
+        sample.elements = abs(size - m->size);
+    else if (m->elements == ELEMENTS_VISITED)
+        sample.elements = m->size > size ? m->size : size;
+    sample.allocs = allocs - m->allocs;
+    sample.alloc_fails = fails - m->fails;
+    metrics_record(metrics, &sample);
+}
+
+static bool do_repeat(int argc, char *argv[]);
+
 /* Execute a command that has already been split into arguments */
 static bool interpret_cmda(int argc, char *argv[])
 {
     if (argc == 0)
         return true;
     /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
+    cmd_element_t *next_cmd = index_find(&cmd_index, argv[0]);
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
+        int saved_argc = running_argc;
+        char **saved_argv = running_argv;
+        running_argc = argc;
+        running_argv = argv;
+
+        /* Kept aside, as quit frees the command */
+        cmd_metrics_t *metrics = next_cmd->metrics;
+        bool opens_block = next_cmd->operation == do_repeat;
+        bool alone = next_cmd->console_only;
+        measure_t m;
+        measure_start(&m, next_cmd->elements);
+        if (alone && web_worker()) {
+            report(1, "'%s' runs on the console only, not in a web session",
+                   argv[0]);
+            ok = false;
+        } else {
+            if (alone)
+                web_pause();
+            ok = next_cmd->operation(argc, argv);
+            if (alone)
+                web_resume();
+        }
+        /* The block of a repeat is measured once it ran, when it is closed */
+        if (!opens_block || !ok)
+            measure_end(&m, metrics, ok);
+
+        running_argc = saved_argc;
+        running_argv = saved_argv;
         if (!ok)
             record_error();
     } else {
@@ -190,22 +366,464 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
-/* Execute a command from a command line */
-static bool interpret_cmd(char *cmdline)
+/* Variables, set by 'set' or counted by repeat, and referenced as $name in
+ * the words of any command. Values have a fixed size, so that a counter is
+ * updated without allocating.
+ */
+#define VAR_LEN 64
+
+typedef struct {
+    char *name;
+    char value[VAR_LEN];
+} var_t;
+
+static __thread name_index_t var_index;
+
+static var_t *set_var(const char *name, const char *value)
 {
-    if (quit_flag)
+    if (strlen(value) >= VAR_LEN) {
+        report(1, "Value of %s longer than %d characters", name, VAR_LEN - 1);
+        return NULL;
+    }
+    var_t *var = index_find(&var_index, name);
+    if (!var) {
+        var = malloc_or_fail(sizeof(var_t), "set_var");
+        var->name = strsave_or_fail(name, "set_var");
+        index_add(&var_index, var->name, var);
+    }
+    strcpy(var->value, value);
+    return var;
+}
+
+static void free_vars()
+{
+    for (size_t i = 0; i < var_index.size; i++) {
+        var_t *var = var_index.slots[i].element;
+        if (var) {
+            free_string(var->name);
+            free_block(var, sizeof(var_t));
+        }
+    }
+    index_clear(&var_index);
+}
+
+/* Words with variables substituted, one arena per level of commands which
+ * run commands themselves, e.g. replay, as the outer words stay in use.
+ */
+#define MAX_EXPAND_DEPTH 8
+
+static __thread struct {
+    char *buf;
+    char **argv;
+    size_t cap; /* Bytes of buf */
+    int argc_cap;
+} expand_arena[MAX_EXPAND_DEPTH];
+static __thread int expand_depth = 0;
+
+/* Whether words reference variables. Comments are shown as written. */
+static bool has_vars(int argc, char *argv[])
+{
+    if (argc && !strcmp(argv[0], "#"))
+        return false;
+    for (int i = 0; i < argc; i++) {
+        if (strchr(argv[i], '$'))
+            return true;
+    }
+    return false;
+}
+
+/* Length of the variable name at s */
+static size_t var_name_len(const char *s)
+{
+    size_t n = 0;
+    while (isalnum((unsigned char) s[n]) || s[n] == '_')
+        n++;
+    return n;
+}
+
+static bool is_var_name(const char *s)
+{
+    size_t n = var_name_len(s);
+    return n && n < VAR_LEN && !s[n];
+}
+
+/* Find the variable named at *sp and move *sp past the name */
+static var_t *find_var(const char **sp)
+{
+    char name[VAR_LEN];
+    size_t n = var_name_len(*sp);
+    if (!n || n >= VAR_LEN) {
+        report(1, "Invalid variable name after '$'");
+        return NULL;
+    }
+    memcpy(name, *sp, n);
+    name[n] = '\0';
+    var_t *var = index_find(&var_index, name);
+    if (!var)
+        report(1, "Unknown variable '%s'", name);
+    *sp += n;
+    return var;
+}
+
+/* Substitute the variables in words into the arena of depth. Return false
+ * if one is not set.
+ */
+static bool expand_vars(int argc, char *argv[], int depth)
+{
+    /* Measured first, so that the arena is grown at most once */
+    size_t len = 0;
+    for (int i = 0; i < argc; i++) {
+        for (const char *s = argv[i]; *s;) {
+            if (*s++ != '$') {
+                len++;
+                continue;
+            }
+            var_t *var = find_var(&s);
+            if (!var)
+                return false;
+            len += strlen(var->value);
+        }
+        len++;
+    }
+
+    if (len > expand_arena[depth].cap) {
+        if (expand_arena[depth].cap)
+            free_block(expand_arena[depth].buf, expand_arena[depth].cap);
+        expand_arena[depth].cap = len > 2 * expand_arena[depth].cap
+                                      ? len
+                                      : 2 * expand_arena[depth].cap;
+        expand_arena[depth].buf =
+            malloc_or_fail(expand_arena[depth].cap, "expand_vars");
+    }
+    if (argc > expand_arena[depth].argc_cap) {
+        if (expand_arena[depth].argc_cap)
+            free_array(expand_arena[depth].argv, expand_arena[depth].argc_cap,
+                       sizeof(char *));
+        expand_arena[depth].argc_cap = argc;
+        expand_arena[depth].argv =
+            calloc_or_fail(argc, sizeof(char *), "expand_vars");
+    }
+
+    char *p = expand_arena[depth].buf;
+    for (int i = 0; i < argc; i++) {
+        expand_arena[depth].argv[i] = p;
+        for (const char *s = argv[i]; *s;) {
+            if (*s++ != '$') {
+                *p++ = s[-1];
+                continue;
+            }
+            var_t *var = find_var(&s);
+            size_t vlen = strlen(var->value);
+            memcpy(p, var->value, vlen);
+            p += vlen;
+        }
+        *p++ = '\0';
+    }
+    return true;
+}
+
+/* Execute a command, substituting variables if it has any */
+static bool interpret_words(int argc, char *argv[], bool vars)
+{
+    if (!vars)
+        return interpret_cmda(argc, argv);
+    if (expand_depth == MAX_EXPAND_DEPTH) {
+        report(1, "Variables nested deeper than %d commands",
+               MAX_EXPAND_DEPTH);
+        record_error();
         return false;
+    }
+    if (!expand_vars(argc, argv, expand_depth)) {
+        record_error();
+        return false;
+    }
+    expand_depth++;
+    bool ok = interpret_cmda(argc, expand_arena[expand_depth - 1].argv);
+    expand_depth--;
+    return ok;
+}
+
+/* Repeat blocks. The commands of a block are split into words once, as they
+ * are read, and run from those words on every iteration, so that memory
+ * stays the same whatever the count.
+ */
+#define MAX_BLOCK_DEPTH 16
 
+typedef struct __block block_t;
+
+typedef struct {
     int argc;
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
+    char **argv;
+    size_t len;     /* Bytes of the words argv points into */
+    bool vars;      /* Some word references a variable */
+    block_t *block; /* Nested block, run instead of the words */
+} block_cmd_t;
+
+struct __block {
+    block_cmd_t head; /* repeat N [VAR] { */
+    block_cmd_t *cmds;
+    int n_cmds, cap;
+};
+
+/* Blocks being read, innermost last */
+static __thread block_t *open_blocks[MAX_BLOCK_DEPTH];
+static __thread int block_depth = 0;
+
+static void save_words(block_cmd_t *c, int argc, char *argv[])
+{
+    c->len = 0;
     for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+        c->len += strlen(argv[i]) + 1;
+    char *p = malloc_or_fail(c->len, "save_words");
+    c->argv = calloc_or_fail(argc, sizeof(char *), "save_words");
+    for (int i = 0; i < argc; i++) {
+        c->argv[i] = p;
+        strcpy(p, argv[i]);
+        p += strlen(argv[i]) + 1;
+    }
+    c->argc = argc;
+    c->vars = has_vars(argc, argv);
+    c->block = NULL;
+}
+
+static void free_words(block_cmd_t *c)
+{
+    free_block(c->argv[0], c->len);
+    free_array(c->argv, c->argc, sizeof(char *));
+}
+
+static void free_repeat(block_t *b)
+{
+    for (int i = 0; i < b->n_cmds; i++) {
+        if (b->cmds[i].block)
+            free_repeat(b->cmds[i].block);
+        else
+            free_words(&b->cmds[i]);
+    }
+    if (b->cap)
+        free_array(b->cmds, b->cap, sizeof(block_cmd_t));
+    free_words(&b->head);
+    free_block(b, sizeof(block_t));
+}
+
+static block_cmd_t *add_block_cmd(block_t *b)
+{
+    if (b->n_cmds == b->cap) {
+        int cap = b->cap ? 2 * b->cap : 8;
+        block_cmd_t *cmds =
+            calloc_or_fail(cap, sizeof(block_cmd_t), "add_block_cmd");
+        if (b->cap) {
+            memcpy(cmds, b->cmds, b->cap * sizeof(block_cmd_t));
+            free_array(b->cmds, b->cap, sizeof(block_cmd_t));
+        }
+        b->cmds = cmds;
+        b->cap = cap;
+    }
+    return &b->cmds[b->n_cmds++];
+}
+
+/* Start reading a block from the words of its repeat line */
+static bool open_repeat(int argc, char *argv[])
+{
+    if ((argc != 3 && argc != 4) || strcmp(argv[argc - 1], "{")) {
+        report(1, "Usage: repeat N [VAR] {");
+        return false;
+    }
+    if (argc == 4 && !is_var_name(argv[2])) {
+        report(1, "Invalid variable name '%s'", argv[2]);
+        return false;
+    }
+    if (block_depth == MAX_BLOCK_DEPTH) {
+        report(1, "Repeat blocks nested deeper than %d", MAX_BLOCK_DEPTH);
+        return false;
+    }
+    block_t *b = calloc_or_fail(1, sizeof(block_t), "open_repeat");
+    save_words(&b->head, argc, argv);
+    open_blocks[block_depth++] = b;
+    return true;
+}
+
+static bool run_repeat(block_t *b)
+{
+    const char *count_word = b->head.argv[1];
+    if (*count_word == '$') {
+        const char *s = count_word + 1;
+        var_t *var = find_var(&s);
+        if (!var) {
+            record_error();
+            return false;
+        }
+        count_word = var->value;
+    }
+    int count = 0;
+    if (!get_int((char *) count_word, &count) || count < 0) {
+        report(1, "Invalid repeat count '%s'", count_word);
+        record_error();
+        return false;
+    }
+    var_t *counter = NULL;
+    if (b->head.argc == 4 && !(counter = set_var(b->head.argv[2], "0"))) {
+        record_error();
+        return false;
+    }
+
+    bool ok = true;
+    for (int i = 0; i < count && !quit_flag; i++) {
+        if (counter)
+            snprintf(counter->value, VAR_LEN, "%d", i);
+        for (int j = 0; j < b->n_cmds && !quit_flag; j++) {
+            block_cmd_t *c = &b->cmds[j];
+            if (c->block)
+                ok &= run_repeat(c->block);
+            else
+                ok &= interpret_words(c->argc, c->argv, c->vars);
+        }
+    }
+    return ok;
+}
+
+/* Add a command line to the innermost block being read, and run the block
+ * once it is closed, unless it is nested in another one.
+ */
+static bool record_line(int argc, char *argv[])
+{
+    block_t *b = open_blocks[block_depth - 1];
+    if (argc == 1 && !strcmp(argv[0], "}")) {
+        block_depth--;
+        if (block_depth) {
+            add_block_cmd(open_blocks[block_depth - 1])->block = b;
+            return true;
+        }
+        /* Recorded as a run of repeat, from the opening of the block */
+        cmd_element_t *cmd = index_find(&cmd_index, "repeat");
+        measure_t m;
+        measure_start(&m, ELEMENTS_NONE);
+        bool ok = run_repeat(b);
+        if (cmd)
+            measure_end(&m, cmd->metrics, ok);
+        free_repeat(b);
+        return ok;
+    }
+
+    bool ok = true;
+    if (!strcmp(argv[0], "repeat")) {
+        ok = open_repeat(argc, argv);
+    } else if (!strcmp(argv[0], "source")) {
+        /* Its commands would only be read after the block */
+        report(1, "Cannot source a file in a repeat block");
+        ok = false;
+    } else {
+        save_words(add_block_cmd(b), argc, argv);
+    }
+    if (!ok)
+        record_error();
+    return ok;
+}
+
+/* Execute a command line, or add it to the repeat block being read */
+static bool interpret_line(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+    if (block_depth)
+        return record_line(argc, argv);
+    if (argc == 1 && !strcmp(argv[0], "}")) {
+        report(1, "No repeat block to close");
+        record_error();
+        return false;
+    }
+    return interpret_words(argc, argv, has_vars(argc, argv));
+}
+
+static bool do_repeat(int argc, char *argv[])
+{
+    return open_repeat(argc, argv);
+}
+
+static bool do_set(int argc, char *argv[])
+{
+    if (argc == 1) {
+        for (size_t i = 0; i < var_index.size; i++) {
+            var_t *var = var_index.slots[i].element;
+            if (var)
+                report(1, "  %-12s %s", var->name, var->value);
+        }
+        return true;
+    }
+    if (argc != 3 || !is_var_name(argv[1])) {
+        report(1, "Usage: %s NAME VALUE", argv[0]);
+        return false;
+    }
+    return set_var(argv[1], argv[2]) != NULL;
+}
+
+static bool do_incr(int argc, char *argv[])
+{
+    int step = 1, value = 0;
+    if ((argc != 2 && argc != 3) || (argc == 3 && !get_int(argv[2], &step))) {
+        report(1, "Usage: %s NAME [N]", argv[0]);
+        return false;
+    }
+    var_t *var = index_find(&var_index, argv[1]);
+    if (!var || !get_int(var->value, &value)) {
+        report(1, "'%s' is not a variable holding a number", argv[1]);
+        return false;
+    }
+    snprintf(var->value, VAR_LEN, "%d", value + step);
+    return true;
+}
+
+/* Execute a command from a command line of len bytes */
+static bool interpret_cmd(const char *cmdline, size_t len)
+{
+    if (quit_flag)
+        return false;
+
+    int argc;
+    char **argv = parse_args(cmdline, len, &argc);
+
+    /* Lines of a block are timed as a whole, under its repeat line */
+    char head[MAX_CHAR] = "";
+    if (block_depth == 1 && argc == 1 && !strcmp(argv[0], "}")) {
+        size_t len = 0;
+        block_cmd_t *h = &open_blocks[0]->head;
+        for (int i = 0; i < h->argc && len < sizeof(head); i++)
+            len += snprintf(head + len, sizeof(head) - len, "%s%s",
+                            i ? " " : "", h->argv[i]);
+    }
+
+    uint64_t start = 0;
+    if (timing_log)
+        init_time(&start);
+    bool ok = interpret_line(argc, argv);
+    if (timing_log && argc && !block_depth) {
+        /* Whole lines, as web workers time their commands too */
+        flockfile(timing_log);
+        fprintf(timing_log, "%.9f", delta_time(&start) / 1e9);
+        if (*head)
+            fprintf(timing_log, "\t%s ... }", head);
+        for (int i = 0; !*head && i < argc; i++)
+            fprintf(timing_log, "%c%s", i ? ' ' : '\t', argv[i]);
+        fputc('\n', timing_log);
+        funlockfile(timing_log);
+    }
 
     return ok;
 }
 
+bool run_cmd(int argc, char *argv[])
+{
+    if (quit_flag)
+        return false;
+    return interpret_line(argc, argv);
+}
+
+int get_running_cmd(char ***argvp)
+{
+    *argvp = running_argv;
+    return running_argc;
+}
+
 /* Set function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf)
 {
@@ -215,17 +833,46 @@ void add_quit_helper(cmd_func_t qf)
         report_event(MSG_FATAL, "Exceeded limit on quit helpers");
 }
 
+bool set_timing_log(const char *file_name)
+{
+    timing_log = fopen(file_name, "w");
+    return timing_log != NULL;
+}
+
+void set_size_helper(int (*sf)(void))
+{
+    size_helper = sf;
+}
+
+void set_session_helper(bool (*sf)(const char *id))
+{
+    session_helper = sf;
+}
+
+void set_worker_helper(bool (*wf)(void))
+{
+    worker_helper = wf;
+}
+
 /* Turn echoing on/off */
 void set_echo(bool on)
 {
     echo = on ? 1 : 0;
 }
 
+/* Free the variables of the calling thread and the blocks it is reading */
+static void free_script(void)
+{
+    free_vars();
+    while (block_depth)
+        free_repeat(open_blocks[--block_depth]);
+}
+
 /* Built-in commands */
 static bool do_quit(int argc, char *argv[])
 {
     cmd_element_t *c = cmd_list;
-    bool ok = true;
+    bool ok = web_stop_workers();
     while (c) {
         cmd_element_t *ele = c;
         c = c->next;
@@ -238,6 +885,9 @@ static bool do_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_element_t));
     }
+    index_clear(&cmd_index);
+    index_clear(&param_index);
+    free_script();
 
     while (buf_stack)
         pop_file();
@@ -246,6 +896,11 @@ static bool do_quit(int argc, char *argv[])
         ok = ok && quit_helpers[i](argc, argv);
     }
 
+    /* Which the count of what was dropped must not be */
+    logger_stop();
+    if (logger_dropped())
+        report(1, "Output dropped: %" PRIu64 " messages", logger_dropped());
+
     quit_flag = true;
     return ok;
 }
@@ -320,17 +975,13 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_element_t *plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
+        param_element_t *plist = index_find(&param_index, name);
+        if (plist) {
+            int oldval = *plist->valp;
+            *plist->valp = value;
+            if (plist->setter)
+                plist->setter(oldval);
+            found = true;
         }
         /* Didn't find parameter */
         if (!found) {
@@ -359,40 +1010,191 @@ static bool do_source(int argc, char *argv[])
 
 static bool do_log(int argc, char *argv[])
 {
-    if (argc < 2) {
+    bool binary = argc > 1 && !strcmp(argv[1], "-b");
+    if (argc < 2 + binary) {
         report(1, "No log file given");
         return false;
     }
 
-    bool result = set_logfile(argv[1]);
+    const char *name = argv[1 + binary];
+    bool result = set_logfile(name, binary);
     if (!result)
-        report(1, "Couldn't open log file '%s'", argv[1]);
+        report(1, "Couldn't open log file '%s'", name);
 
     return result;
 }
 
+/* 0 writes output as it comes, 1 from a background thread, and 2 from a
+ * background thread which drops what it cannot keep up with
+ */
+static int async_log = 0;
+
+static void async_changed(int oldval)
+{
+    if (async_log < 0 || async_log > 2 || !set_async_log(async_log)) {
+        report(1, "Cannot set async to %d, keeping %d", async_log, oldval);
+        async_log = oldval;
+        return;
+    }
+    if (!async_log && logger_dropped())
+        report(1, "Output dropped: %" PRIu64 " messages", logger_dropped());
+}
+
 static bool do_time(int argc, char *argv[])
 {
-    double delta = delta_time(&last_time);
+    uint64_t delta = delta_time(&last_time);
+    char buf[2][32];
     bool ok = true;
     if (argc <= 1) {
-        double elapsed = last_time - first_time;
-        report(1, "Elapsed time = %.3f, Delta time = %.3f", elapsed, delta);
-    } else {
+        uint64_t elapsed = last_time - first_time;
+        report(1, "Elapsed time = %s, Delta time = %s",
+               format_time(buf[0], sizeof(buf[0]), elapsed),
+               format_time(buf[1], sizeof(buf[1]), delta));
+        return ok;
+    }
+
+    int reps = 1;
+    if (argc >= 3 && !strcmp(argv[1], "-r")) {
+        if (!get_int(argv[2], &reps) || reps < 1 || argc == 3) {
+            report(1, "Usage: %s [-r N] cmd arg ...", argv[0]);
+            return false;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    /* The high-water mark is restarted so that it reflects the command, and
+     * restored afterwards for the 'mem' command
+     */
+    mem_stat_t before, after;
+    get_memory_stat(&before);
+    reset_memory_mark();
+    time_stat_t stat;
+    time_stat_init(&stat);
+    for (int i = 0; ok && i < reps; i++) {
+        init_time(&last_time);
         ok = interpret_cmda(argc - 1, argv + 1);
         if (block_flag) {
             block_timing = true;
-        } else {
-            delta = delta_time(&last_time);
-            report(1, "Delta time = %.3f", delta);
+            restore_memory_mark(before.mark_bytes);
+            return ok;
         }
+        time_stat_add(&stat, delta_time(&last_time));
     }
 
+    get_memory_stat(&after);
+    restore_memory_mark(before.mark_bytes);
+    if (stat.n == 1) {
+        report(1, "Delta time = %s",
+               format_time(buf[0], sizeof(buf[0]), stat.mean));
+    } else {
+        char more[2][32];
+        report(1, "Time of %lu runs: min %s, mean %s, max %s, stddev %s",
+               (unsigned long) stat.n,
+               format_time(buf[0], sizeof(buf[0]), stat.min),
+               format_time(buf[1], sizeof(buf[1]), stat.mean),
+               format_time(more[0], sizeof(more[0]), stat.max),
+               format_time(more[1], sizeof(more[1]), time_stat_stddev(&stat)));
+    }
+    report(1, "Delta memory = %+ld bytes, peak = +%zu bytes",
+           (long) (after.current_bytes - before.current_bytes),
+           after.mark_bytes - before.current_bytes);
     return ok;
 }
 
+static bool do_perf(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "%s needs a command to count", argv[0]);
+        return false;
+    }
+
+    perf_counters_t c;
+    int before = size_helper ? size_helper() : 0;
+    int n = perf_start(&c);
+    bool ok = interpret_cmda(argc - 1, argv + 1);
+    perf_stop(&c);
+    int after = size_helper ? size_helper() : 0;
+    /* Elements the command built or went through */
+    int elements = before > after ? before : after;
+
+    if (!n)
+        report(1,
+               "Hardware counters not available, see "
+               "/proc/sys/kernel/perf_event_paranoid");
+    for (int i = 0; i < N_PERF_EVENTS; i++) {
+        if (!c.valid[i])
+            continue;
+        char extra[64] = "";
+        if (i == PERF_INSTRUCTIONS && c.valid[PERF_CYCLES] &&
+            c.count[PERF_CYCLES])
+            snprintf(extra, sizeof(extra), "  (IPC %.2f)",
+                     (double) c.count[i] / c.count[PERF_CYCLES]);
+        else if (i != PERF_CYCLES && elements)
+            snprintf(extra, sizeof(extra), "  (%.2f per element)",
+                     (double) c.count[i] / elements);
+        report(1, "%-13s = %" PRIu64 "%s", perf_event_name(i), c.count[i],
+               extra);
+    }
+    return ok;
+}
+
+static bool do_metrics(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "Usage: %s [file]", argv[0]);
+        return false;
+    }
+    if (argc == 1) {
+        metrics_report();
+        return true;
+    }
+    if (!metrics_write_file(argv[1])) {
+        report(1, "Couldn't write metrics to '%s'", argv[1]);
+        return false;
+    }
+    return true;
+}
+
 static bool use_linenoise = true;
-static int web_fd;
+static int web_fd = -1;
+
+static bool web_done()
+{
+    return quit_flag;
+}
+
+/* Enter session id for a web client, or leave it with NULL. Blocks and
+ * variables of a web worker last for one request, as the sessions of a
+ * worker only share it by chance.
+ */
+static bool enter_session(const char *id)
+{
+    if (!id && web_worker())
+        free_script();
+    return session_helper(id);
+}
+
+/* Run by each web worker as it stops, to free what its commands left */
+static bool stop_worker(void)
+{
+    free_script();
+    if (arg_cap) {
+        free_block(arg_buf, arg_cap);
+        free_array(arg_argv, arg_cap / 2 + 1, sizeof(char *));
+        arg_cap = 0;
+    }
+    for (int i = 0; i < MAX_EXPAND_DEPTH; i++) {
+        if (expand_arena[i].cap)
+            free_block(expand_arena[i].buf, expand_arena[i].cap);
+        if (expand_arena[i].argc_cap)
+            free_array(expand_arena[i].argv, expand_arena[i].argc_cap,
+                       sizeof(char *));
+        expand_arena[i].cap = 0;
+        expand_arena[i].argc_cap = 0;
+    }
+    return !worker_helper || worker_helper();
+}
 
 static bool do_web(int argc, char *argv[])
 {
@@ -404,7 +1206,14 @@ static bool do_web(int argc, char *argv[])
 
     web_fd = web_open(port);
     if (web_fd > 0) {
+        logger_flush();
         printf("listen on port %d, fd is %d\n", port, web_fd);
+        fflush(stdout);
+        web_set_cmd(interpret_cmd, web_done, size_helper);
+        web_set_session(session_helper ? enter_session : NULL);
+        if (!web_set_workers(web_workers, stop_worker))
+            report(1, "Cannot start %d web workers, sessions stay here",
+                   web_workers);
         line_set_eventmux_callback(web_eventmux);
         use_linenoise = false;
     } else {
@@ -419,6 +1228,8 @@ void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    index_clear(&cmd_index);
+    index_clear(&param_index);
     err_cnt = 0;
     quit_flag = false;
 
@@ -428,15 +1239,49 @@ void init_cmd()
                 "[name val]");
     ADD_COMMAND(quit, "Exit program", "");
     ADD_COMMAND(source, "Read commands from source file", "");
-    ADD_COMMAND(log, "Copy output to file", "file");
-    ADD_COMMAND(time, "Time command execution", "cmd arg ...");
-    ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
+    ADD_COMMAND(log, "Copy output to file, in binary records with -b",
+                "[-b] file");
+    ADD_COMMAND(time,
+                "Time command execution, N times with -r, and report memory "
+                "delta",
+                "[-r N] cmd arg ...");
+    ADD_COMMAND(perf,
+                "Count cycles, instructions, cache and branch misses and page "
+                "faults of command",
+                "cmd arg ...");
+    ADD_COMMAND(metrics,
+                "Show counts and times of each command, or write them to file "
+                "in Prometheus text format",
+                "[file]");
+    ADD_COMMAND(web,
+                "Read commands from builtin web server, metrics at /metrics",
+                "[port]");
+    ADD_COMMAND(repeat,
+                "Run the commands up to a line holding '}' N times, counting "
+                "in VAR from 0",
+                "N [VAR] {");
+    ADD_COMMAND(set, "Set variable, referenced as $NAME in any command",
+                "[NAME VALUE]");
+    ADD_COMMAND(incr, "Add N to number held by variable (default: N == 1)",
+                "NAME [N]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
+
+    /* Commands which work on the state of the whole program */
+    char *console_only[] = {"option", "quit", "source", "log", "time", "web"};
+    for (size_t i = 0; i < sizeof(console_only) / sizeof(console_only[0]); i++)
+        set_cmd_console_only(console_only[i]);
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
+    add_param("async", &async_log,
+              "Write output from a thread (1), dropping what it cannot take "
+              "(2)",
+              async_changed);
+    add_param("web_workers", &web_workers,
+              "Threads running the commands of web sessions, from web on",
+              NULL);
 
     init_in();
     init_time(&last_time);
@@ -459,7 +1304,24 @@ static bool push_file(char *fname)
 
     rio_t *rnew = malloc_or_fail(sizeof(rio_t), "push_file");
     rnew->fd = fd;
-    rnew->count = 0;
+    rnew->mapped = false;
+
+    /* Pipes and terminals are read through the buffer */
+    struct stat st;
+    if (fname && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            rnew->buf = map;
+            rnew->size = rnew->count = st.st_size;
+            rnew->mapped = true;
+        }
+    }
+    if (!rnew->mapped) {
+        rnew->buf = malloc_or_fail(RIO_BUFSIZE, "push_file");
+        rnew->size = RIO_BUFSIZE;
+        rnew->count = 0;
+    }
     rnew->bufptr = rnew->buf;
     rnew->prev = buf_stack;
     buf_stack = rnew;
@@ -474,6 +1336,10 @@ static void pop_file()
         rio_t *rsave = buf_stack;
         buf_stack = rsave->prev;
         close(rsave->fd);
+        if (rsave->mapped)
+            munmap(rsave->buf, rsave->size);
+        else
+            free_block(rsave->buf, rsave->size);
         free_block(rsave, sizeof(rio_t));
     }
 }
@@ -484,60 +1350,71 @@ static void init_in()
     buf_stack = NULL;
 }
 
-/* Read command from input file.
- * When hit EOF, close that file and return NULL
+/* Read more of the file behind the unread bytes, which are moved to the
+ * start of the buffer first. The buffer is doubled when they fill it, so
+ * that no line is cut. Return false at EOF.
  */
-static char *readline()
+static bool rio_fill(rio_t *rp)
 {
-    char c;
-    char *lptr = linebuf;
+    if (rp->count == rp->size) {
+        char *buf = malloc_or_fail(2 * rp->size, "rio_fill");
+        memcpy(buf, rp->bufptr, rp->count);
+        free_block(rp->buf, rp->size);
+        rp->buf = buf;
+        rp->size *= 2;
+    } else {
+        memmove(rp->buf, rp->bufptr, rp->count);
+    }
+    rp->bufptr = rp->buf;
 
-    if (!buf_stack)
-        return NULL;
+    ssize_t n = read(rp->fd, rp->buf + rp->count, rp->size - rp->count);
+    if (n <= 0)
+        return false;
+    rp->count += n;
+    return true;
+}
 
-    for (int cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
-        if (buf_stack->count <= 0) {
-            /* Need to read from input file */
-            buf_stack->count = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
-            buf_stack->bufptr = buf_stack->buf;
-            if (buf_stack->count <= 0) {
-                /* Encountered EOF */
-                pop_file();
-                if (cnt > 0) {
-                    /* Last line of file did not terminate with newline. */
-                    /*  Terminate line & return it */
-                    *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
-                    return linebuf;
-                }
-                return NULL;
-            }
-        }
+/* Read command from input file, returning it in place with its length,
+ * '\n' included, through lenp. It stays valid until the next call.
+ * When hit EOF, close that file and return NULL
+ */
+static char *readline(size_t *lenp)
+{
+    rio_t *rp = buf_stack;
+    if (!rp)
+        return NULL;
 
-        /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->count--;
-        if (c == '\n')
+    /* Bytes already searched are not searched again after a refill */
+    size_t scanned = 0;
+    char *nl;
+    while (!(nl = memchr(rp->bufptr + scanned, '\n', rp->count - scanned))) {
+        scanned = rp->count;
+        if (rp->mapped || !rio_fill(rp))
             break;
     }
 
-    if (c != '\n') {
-        /* Hit buffer limit.  Artificially terminate line */
-        *lptr++ = '\n';
+    size_t len;
+    if (nl) {
+        len = nl + 1 - rp->bufptr;
+    } else if (rp->count) {
+        /* Last line of file did not terminate with newline */
+        len = rp->count;
+    } else {
+        /* Encountered EOF */
+        pop_file();
+        return NULL;
     }
-    *lptr++ = '\0';
 
+    char *line = rp->bufptr;
+    rp->bufptr += len;
+    rp->count -= len;
     if (echo) {
         report_noreturn(1, prompt);
-        report_noreturn(1, linebuf);
+        report_noreturn(1, "%.*s%s", (int) len, line, nl ? "" : "\n");
     }
 
-    return linebuf;
+    *lenp = len;
+    return line;
 }
 
 static bool cmd_done()
@@ -554,7 +1431,6 @@ static bool cmd_done()
  * nfds should be set to the maximum file descriptor for network sockets.
  * If nfds == 0, this indicates that there is no pending network activity
  */
-int web_connfd;
 static int cmd_select(int nfds,
                       fd_set *readfds,
                       fd_set *writefds,
@@ -582,15 +1458,23 @@ static int cmd_select(int nfds,
             FD_SET(web_fd, readfds);
 
         if (infd == STDIN_FILENO && prompt_flag) {
+            /* The prompt comes after the output before it */
+            logger_flush();
+            /* Serve clients until there is something to read */
+            if (web_fd > 0 && web_eventmux(NULL))
+                return 0;
             char *cmdline = linenoise(prompt);
             if (cmdline)
-                interpret_cmd(cmdline);
+                interpret_cmd(cmdline, strlen(cmdline));
+            else if (web_fd > 0)
+                web_serve(); /* Clients have the last word */
             fflush(stdout);
             prompt_flag = true;
         } else if (infd != STDIN_FILENO) {
-            char *cmdline = readline();
+            size_t len;
+            char *cmdline = readline(&len);
             if (cmdline)
-                interpret_cmd(cmdline);
+                interpret_cmd(cmdline, len);
         }
     }
     return 0;
@@ -601,6 +1485,8 @@ bool finish_cmd()
     bool ok = true;
     if (!quit_flag)
         ok = ok && do_quit(0, NULL);
+    /* Workers which saw the error limit stop here */
+    ok = web_stop_workers() && ok;
     has_infile = false;
     return ok && err_cnt == 0;
 }
@@ -656,7 +1542,7 @@ bool run_console(char *infile_name)
     if (!has_infile) {
         char *cmdline;
         while (use_linenoise && (cmdline = linenoise(prompt))) {
-            interpret_cmd(cmdline);
+            interpret_cmd(cmdline, strlen(cmdline));
             line_history_add(cmdline);       /* Add to the history. */
             line_history_save(HISTORY_FILE); /* Save the history on disk. */
             line_free(cmdline);
@@ -671,6 +1557,9 @@ bool run_console(char *infile_name)
     } else {
         while (!cmd_done())
             cmd_select(0, NULL, NULL, NULL, NULL);
+        /* A script which started the web server leaves it to the clients */
+        if (web_fd > 0 && !quit_flag)
+            web_serve();
     }
 
     return err_cnt == 0;
@@ -5,6 +5,7 @@
 #include <sys/select.h>
 
 #include "linenoise.h"
+#include "metrics.h"
 
 #define HISTORY_FILE ".cmd_history"
 
@@ -18,12 +19,22 @@ typedef bool (*cmd_func_t)(int argc, char *argv[]);
 
 /* Information about each command */
 
+/* Queue elements the metrics of a command count */
+typedef enum {
+    ELEMENTS_NONE,    /* None, it does not work on the queue */
+    ELEMENTS_CHANGED, /* Those it inserted or removed */
+    ELEMENTS_VISITED, /* Those of the whole queue, which it goes through */
+} cmd_elements_t;
+
 /* Organized as linked list in alphabetical order */
 typedef struct __cmd_element {
     char *name;
     cmd_func_t operation;
     char *summary;
     char *param;
+    cmd_metrics_t *metrics;
+    cmd_elements_t elements;
+    bool console_only;
     struct __cmd_element *next;
 } cmd_element_t;
 
@@ -47,6 +58,16 @@ void init_cmd();
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *parameter);
 #define ADD_COMMAND(cmd, msg, param) add_cmd(#cmd, do_##cmd, msg, param)
 
+/* Set which queue elements the metrics of command name count, by default
+ * none
+ */
+void set_cmd_elements(char *name, cmd_elements_t elements);
+
+/* Make command name one which works on the state of the whole program: web
+ * workers refuse it, and wait while the console thread runs it
+ */
+void set_cmd_console_only(char *name);
+
 /* Add a new parameter */
 void add_param(char *name, int *valp, char *summary, setter_func_t setter);
 
@@ -56,6 +77,38 @@ bool get_int(char *vname, int *loc);
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf);
 
+/* Write the time in seconds and the text of every command line to file, one
+ * tab separated line each. Return false if the file cannot be opened.
+ */
+bool set_timing_log(const char *file_name);
+
+/* Set function giving the number of elements commands work on, which perf
+ * reports counts per element of
+ */
+void set_size_helper(int (*sf)(void));
+
+/* Set function making the state of session id, which web clients may name,
+ * the one commands work on, or with id NULL, going back to that of the
+ * thread. The console works in session "". Return false when the session
+ * cannot be created.
+ */
+void set_session_helper(bool (*sf)(const char *id));
+
+/* Set function run by each web worker as it stops, which ends the sessions
+ * the worker ran. Return false if it could not clean up after them.
+ */
+void set_worker_helper(bool (*wf)(void));
+
+/* Execute a command already split into words, as if it were read from a
+ * trace. Return false when it fails or execution has been stopped.
+ */
+bool run_cmd(int argc, char *argv[]);
+
+/* Get the innermost command being executed, argc is 0 when there is none.
+ * Only reads plain memory, so it may be called from a signal handler.
+ */
+int get_running_cmd(char ***argvp);
+
 /* Turn echoing on/off */
 void set_echo(bool on);
 
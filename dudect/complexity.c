@@ -0,0 +1,332 @@
+/** Empirical complexity of queue operations.
+ *
+ * The operation is timed with the dudect cycle counter on queues of
+ * geometrically spaced sizes, and the median times are fitted by least squares against
+ *   cycles = a + b * f(n)
+ * for f(n) in 1, log n, n, n log n and n^2. The residuals are weighted by the
+ * inverse square of the time, so that every size counts about the same
+ * instead of the largest one dominating. The model with the smallest
+ * residual wins, and the confidence compares it with the runner-up.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "complexity.h"
+#include "cpucycles.h"
+#include "queue.h"
+#include "random.h"
+
+/* Number of sorted queues merged by the merge operation */
+#define MERGE_WAYS 4
+
+/* Larger than the last level cache of common machines */
+#define FLUSH_SIZE (32 << 20)
+
+/* Shapes of the input queues */
+typedef enum {
+    INPUT_RANDOM,      /* Random strings */
+    INPUT_SORTED_DUPS, /* Sorted strings, some of them repeated */
+    INPUT_CHAIN,       /* Chain of MERGE_WAYS sorted queues */
+} input_t;
+
+typedef struct {
+    const char *name;
+    complexity_t expect;
+    input_t input;
+    /* Timed operation on head, a queue or a chain, of n elements. Return the
+     * number of elements expected afterwards, or -1 if it may vary.
+     */
+    int (*run)(struct list_head *head, int n, int param);
+} scaling_op_t;
+
+static int run_size(struct list_head *head, int n, int param)
+{
+    return q_size(head) == n ? n : -2;
+}
+
+static int run_reverse(struct list_head *head, int n, int param)
+{
+    q_reverse(head);
+    return n;
+}
+
+static int run_reverseK(struct list_head *head, int n, int param)
+{
+    q_reverseK(head, param);
+    return n;
+}
+
+static int run_swap(struct list_head *head, int n, int param)
+{
+    q_swap(head);
+    return n;
+}
+
+static int run_delete_mid(struct list_head *head, int n, int param)
+{
+    return q_delete_mid(head) ? n - 1 : -2;
+}
+
+static int run_dedup(struct list_head *head, int n, int param)
+{
+    return q_delete_dup(head) ? -1 : -2;
+}
+
+static int run_sort(struct list_head *head, int n, int param)
+{
+    q_sort(head, false);
+    return n;
+}
+
+static int run_ascend(struct list_head *head, int n, int param)
+{
+    q_ascend(head);
+    return -1;
+}
+
+static int run_descend(struct list_head *head, int n, int param)
+{
+    q_descend(head);
+    return -1;
+}
+
+static int run_merge(struct list_head *head, int n, int param)
+{
+    return q_merge(head, false) == n ? n : -2;
+}
+
+static const scaling_op_t scaling_ops[] = {
+    {"size", CPLX_N, INPUT_RANDOM, run_size},
+    {"reverse", CPLX_N, INPUT_RANDOM, run_reverse},
+    {"reverseK", CPLX_N, INPUT_RANDOM, run_reverseK},
+    {"swap", CPLX_N, INPUT_RANDOM, run_swap},
+    {"delete_mid", CPLX_N, INPUT_RANDOM, run_delete_mid},
+    {"dedup", CPLX_N, INPUT_SORTED_DUPS, run_dedup},
+    {"sort", CPLX_N_LOG_N, INPUT_RANDOM, run_sort},
+    {"ascend", CPLX_N, INPUT_RANDOM, run_ascend},
+    {"descend", CPLX_N, INPUT_RANDOM, run_descend},
+    {"merge", CPLX_N, INPUT_CHAIN, run_merge},
+};
+
+#define N_SCALING_OPS (int) (sizeof(scaling_ops) / sizeof(scaling_ops[0]))
+
+int find_scaling_op(const char *name)
+{
+    for (int i = 0; i < N_SCALING_OPS; i++) {
+        if (!strcmp(scaling_ops[i].name, name))
+            return i;
+    }
+    return -1;
+}
+
+const char *scaling_op_name(int op)
+{
+    return scaling_ops[op].name;
+}
+
+complexity_t scaling_op_expect(int op)
+{
+    return scaling_ops[op].expect;
+}
+
+int n_scaling_ops(void)
+{
+    return N_SCALING_OPS;
+}
+
+/* Build a queue of the i-th of every ways values, so that the queues of a
+ * chain interleave when merged.
+ */
+static struct list_head *build_queue(input_t input, int n, int ways, int i)
+{
+    struct list_head *head = q_new();
+    if (!head)
+        return NULL;
+
+    char buf[16];
+    for (int k = i; k < n; k += ways) {
+        if (input == INPUT_RANDOM) {
+            for (int j = 0; j < 7; j++)
+                buf[j] = 'a' + prng_below(26);
+            buf[7] = '\0';
+        } else {
+            /* 0, 0, 1, 2, 2, 3, ... for duplicates */
+            int v = input == INPUT_SORTED_DUPS ? k * 2 / 3 : k;
+            snprintf(buf, sizeof(buf), "%08d", v);
+        }
+        if (!q_insert_tail(head, buf)) {
+            q_free(head);
+            return NULL;
+        }
+    }
+    return head;
+}
+
+static void free_input(input_t input, struct list_head *head)
+{
+    if (input != INPUT_CHAIN) {
+        q_free(head);
+        return;
+    }
+
+    queue_contex_t *ctx, *tmp;
+    list_for_each_entry_safe (ctx, tmp, head, chain) {
+        q_free(ctx->q);
+        free(ctx);
+    }
+}
+
+/* Build the input of op with n elements into chain, return its head */
+static struct list_head *build_input(input_t input,
+                                     int n,
+                                     struct list_head *chain)
+{
+    if (input != INPUT_CHAIN)
+        return build_queue(input, n, 1, 0);
+
+    INIT_LIST_HEAD(chain);
+    for (int i = 0; i < MERGE_WAYS; i++) {
+        queue_contex_t *ctx = malloc(sizeof(queue_contex_t));
+        if (!ctx) {
+            free_input(input, chain);
+            return NULL;
+        }
+        ctx->q = build_queue(input, n, MERGE_WAYS, i);
+        ctx->size = q_size(ctx->q);
+        ctx->id = i;
+        list_add_tail(&ctx->chain, chain);
+        if (!ctx->q) {
+            free_input(input, chain);
+            return NULL;
+        }
+    }
+    return chain;
+}
+
+/* Evict the input from the caches. Otherwise the small queues are timed out
+ * of L1 and the large ones out of memory, and the cost per element growing
+ * with the size passes for a higher complexity.
+ */
+static void flush_cache(void)
+{
+    static uint8_t buf[FLUSH_SIZE];
+    for (size_t i = 0; i < FLUSH_SIZE; i += 64)
+        ((volatile uint8_t *) buf)[i]++;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double model(complexity_t cplx, double n)
+{
+    switch (cplx) {
+    case CPLX_1:
+        return 1;
+    case CPLX_LOG_N:
+        return log2(n);
+    case CPLX_N:
+        return n;
+    case CPLX_N_LOG_N:
+        return n * log2(n);
+    default:
+        return n * n;
+    }
+}
+
+/* Weighted residual of the least squares fit of y = a + b * f(n) */
+static double fit(complexity_t cplx, const complexity_result_t *res)
+{
+    double sw = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (int i = 0; i < COMPLEXITY_N_SIZES; i++) {
+        double w = 1 / (res->cycles[i] * res->cycles[i]);
+        double x = model(cplx, res->size[i]), y = res->cycles[i];
+        sw += w;
+        sx += w * x;
+        sy += w * y;
+        sxx += w * x * x;
+        sxy += w * x * y;
+    }
+
+    double a = sy / sw, b = 0;
+    if (cplx != CPLX_1) {
+        b = (sw * sxy - sx * sy) / (sw * sxx - sx * sx);
+        /* Time does not go down with the size */
+        if (b < 0)
+            return INFINITY;
+        a = (sy - b * sx) / sw;
+    }
+
+    double rss = 0;
+    for (int i = 0; i < COMPLEXITY_N_SIZES; i++) {
+        double w = 1 / (res->cycles[i] * res->cycles[i]);
+        double e = res->cycles[i] - a - b * model(cplx, res->size[i]);
+        rss += w * e * e;
+    }
+    return rss;
+}
+
+bool estimate_complexity(int op, int param, complexity_result_t *res)
+{
+    const scaling_op_t *s = &scaling_ops[op];
+    struct list_head chain;
+
+    for (int i = 0; i < COMPLEXITY_N_SIZES; i++) {
+        int n = 1 << (COMPLEXITY_MIN_LOG + i);
+        double cycles[COMPLEXITY_REPS];
+        for (int r = 0; r < COMPLEXITY_REPS; r++) {
+            struct list_head *head = build_input(s->input, n, &chain);
+            if (!head)
+                return false;
+
+            flush_cache();
+            int64_t before = cpucycles_start();
+            int expect = s->run(head, n, param);
+            int64_t after = cpucycles_stop();
+
+            struct list_head *q =
+                s->input == INPUT_CHAIN
+                    ? list_first_entry(head, queue_contex_t, chain)->q
+                    : head;
+            bool ok = expect != -2 && (expect == -1 || q_size(q) == expect);
+            free_input(s->input, head);
+            if (!ok)
+                return false;
+            cycles[r] = after - before - cpucycles_overhead;
+        }
+        qsort(cycles, COMPLEXITY_REPS, sizeof(double), cmp_double);
+        res->size[i] = n;
+        /* A cheap operation on a small queue may take no longer than the
+         * overhead of the counter. At least a cycle keeps the weights of the
+         * fit finite and positive.
+         */
+        res->cycles[i] = fmax(cycles[COMPLEXITY_REPS / 2], 1);
+    }
+
+    double rss[N_CPLX];
+    res->best = CPLX_1;
+    for (int c = 0; c < N_CPLX; c++) {
+        rss[c] = fit(c, res);
+        if (rss[c] < rss[res->best])
+            res->best = c;
+    }
+    res->next = res->best ? CPLX_1 : CPLX_LOG_N;
+    for (int c = 0; c < N_CPLX; c++) {
+        if (c != res->best && rss[c] < rss[res->next])
+            res->next = c;
+    }
+
+    /* The constant model is the weighted mean, so it gives the total sum of
+     * squares.
+     */
+    res->r2 = rss[CPLX_1] > 0 ? 1 - rss[res->best] / rss[CPLX_1] : 1;
+    res->confidence = isinf(rss[res->next]) || rss[res->next] == 0
+                          ? 1
+                          : 1 - rss[res->best] / rss[res->next];
+    return true;
+}
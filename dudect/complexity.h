@@ -0,0 +1,38 @@
+#ifndef DUDECT_COMPLEXITY_H
+#define DUDECT_COMPLEXITY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "constant.h"
+
+/* Queue sizes are 2^COMPLEXITY_MIN_LOG .. 2^COMPLEXITY_MAX_LOG */
+#define COMPLEXITY_MIN_LOG 6
+#define COMPLEXITY_MAX_LOG 14
+#define COMPLEXITY_N_SIZES (COMPLEXITY_MAX_LOG - COMPLEXITY_MIN_LOG + 1)
+
+/* Timed runs at each size, the median of which is kept */
+#define COMPLEXITY_REPS 9
+
+typedef struct {
+    int size[COMPLEXITY_N_SIZES];
+    double cycles[COMPLEXITY_N_SIZES]; /* Median cycles at each size */
+    complexity_t best;                 /* Model with the smallest residual */
+    complexity_t next;                 /* Runner-up model */
+    double r2;                         /* Coefficient of determination */
+    double confidence; /* 1 - residual of best / residual of next */
+} complexity_result_t;
+
+/* Operations which can be estimated, -1 if name is not one of them */
+int find_scaling_op(const char *name);
+const char *scaling_op_name(int op);
+complexity_t scaling_op_expect(int op);
+int n_scaling_ops(void);
+
+/* Time operation op over geometrically spaced queue sizes and fit the
+ * results against the complexity models. param is the k of reverseK.
+ * Return false if the operation misbehaved.
+ */
+bool estimate_complexity(int op, int param, complexity_result_t *res);
+
+#endif
@@ -7,48 +7,149 @@
 #include "queue.h"
 #include "random.h"
 
+/* Largest queue the measurements need */
+#define POOL_SIZE 10000
+
 /* Maintain a queue independent from the qtest since
- * we do not want the test to affect the original functionality
+ * we do not want the test to affect the original functionality.
+ * Every measuring thread has its own queue and strings.
+ *
+ * Building a queue of up to POOL_SIZE elements for every measurement would
+ * take far longer than the measured operation. Instead, the queue is built
+ * once with POOL_SIZE elements, which are remembered in pool, and a queue of
+ * n elements is carved out of it by linking the head to the first n of them.
+ * The element added or removed by the measured operation is taken back
+ * afterwards.
  */
-static struct list_head *l = NULL;
+static __thread struct list_head *l = NULL;
+static __thread element_t *pool[POOL_SIZE];
 
-#define dut_new() ((void) (l = q_new()))
+static __thread char random_string[N_MEASURES][8];
+static __thread int random_string_iter = 0;
 
-#define dut_size(n)                                \
-    do {                                           \
-        for (int __iter = 0; __iter < n; ++__iter) \
-            q_size(l);                             \
-    } while (0)
+static char *get_random_string(void)
+{
+    random_string_iter = (random_string_iter + 1) % N_MEASURES;
+    return random_string[random_string_iter];
+}
 
-#define dut_insert_head(s, n)    \
-    do {                         \
-        int j = n;               \
-        while (j--)              \
-            q_insert_head(l, s); \
-    } while (0)
+/* Build the queue of the pool */
+static bool pool_build(void)
+{
+    l = q_new();
+    if (!l)
+        return false;
+    for (int i = 0; i < POOL_SIZE; i++)
+        q_insert_head(l, get_random_string());
+    if (q_size(l) != POOL_SIZE) {
+        q_free(l);
+        l = NULL;
+        return false;
+    }
 
-#define dut_insert_tail(s, n)    \
-    do {                         \
-        int j = n;               \
-        while (j--)              \
-            q_insert_tail(l, s); \
-    } while (0)
+    int i = 0;
+    element_t *e;
+    list_for_each_entry (e, l, list)
+        pool[i++] = e;
+    return true;
+}
 
-#define dut_free() ((void) (q_free(l)))
+/* Make l the queue of the first n elements of the pool */
+static void pool_carve(int n)
+{
+    if (!n) {
+        INIT_LIST_HEAD(l);
+        return;
+    }
+    l->next = &pool[0]->list;
+    pool[0]->list.prev = l;
+    l->prev = &pool[n - 1]->list;
+    pool[n - 1]->list.next = l;
+}
 
-static char random_string[N_MEASURES][8];
-static int random_string_iter = 0;
+/* Check that l is back to the first n elements of the pool, and link them
+ * to the rest of the pool again.
+ */
+static bool pool_restore(int n)
+{
+    if (!n)
+        return list_empty(l);
+    if (l->next != &pool[0]->list || l->prev != &pool[n - 1]->list)
+        return false;
+    if (n < POOL_SIZE)
+        pool[n - 1]->list.next = &pool[n]->list;
+    return true;
+}
 
-/* Implement the necessary queue interface to simulation */
-void init_dut(void)
+/* Give up on a measurement on the first n elements, keeping the pool with
+ * pool_fail() only if the operation left it intact. The blocks are freed from
+ * the most recently allocated on, which the cautious mode of the harness
+ * finds first.
+ */
+static bool pool_discard(int n)
 {
+    q_free(l);
     l = NULL;
+    for (int i = n; i < POOL_SIZE; i++)
+        q_release_element(pool[i]);
+    return false;
 }
 
-static char *get_random_string(void)
+static bool pool_fail(int n)
 {
-    random_string_iter = (random_string_iter + 1) % N_MEASURES;
-    return random_string[random_string_iter];
+    return pool_restore(n) ? false : pool_discard(n);
+}
+
+/* Release the element inserted at the head or tail of the first n */
+static bool pool_undo_insert(int n, bool tail)
+{
+    if (list_empty(l))
+        return false;
+    element_t *e = list_entry(tail ? l->prev : l->next, element_t, list);
+    list_del(&e->list);
+    q_release_element(e);
+    return pool_restore(n);
+}
+
+/* Put back the element removed from the head or tail of the first n */
+static bool pool_undo_remove(int n, element_t *e, bool tail)
+{
+    if (tail)
+        list_add_tail(&e->list, l);
+    else
+        list_add(&e->list, l);
+    return pool_restore(n);
+}
+
+/* Check that l holds the first n elements of the pool, with element perm(i)
+ * at position i, and link them back in the order of the pool.
+ */
+static bool pool_unpermute(int n, int (*perm)(int i, int n))
+{
+    struct list_head *p = l->next;
+    for (int i = 0; i < n; i++, p = p->next) {
+        if (p != &pool[perm(i, n)]->list)
+            return pool_discard(n);
+    }
+    if (p != l)
+        return pool_discard(n);
+
+    for (int i = 1; i < n; i++) {
+        pool[i - 1]->list.next = &pool[i]->list;
+        pool[i]->list.prev = &pool[i - 1]->list;
+    }
+    pool_carve(n);
+    return pool_restore(n);
+}
+
+/* Implement the necessary queue interface to simulation */
+void free_dut(void)
+{
+    if (!l)
+        return;
+    pool_carve(POOL_SIZE);
+    q_free(l);
+    l = NULL;
 }
 
 void prepare_inputs(uint8_t *input_data, uint8_t *classes)
@@ -67,96 +168,242 @@ void prepare_inputs(uint8_t *input_data, uint8_t *classes)
     }
 }
 
+/* State of one measurement, passed from setup to run to check */
+typedef struct {
+    int n;        /* Number of elements of the queue */
+    int size;     /* q_size() before the operation */
+    char *s;      /* String to insert */
+    int ret;      /* Return value of the operation */
+    element_t *e; /* Element removed by the operation */
+} dut_arg_t;
+
+/* Operation under test. setup prepares a queue of arg->n elements, run is
+ * the timed part, and check verifies the outcome and restores the queue.
+ * setup and check return false if the implementation misbehaved.
+ */
+typedef struct {
+    const char *name;
+    complexity_t expect;
+    int min_size; /* Smallest queue the operation is measured on */
+    bool (*setup)(dut_arg_t *arg);
+    void (*run)(dut_arg_t *arg);
+    bool (*check)(dut_arg_t *arg);
+} dut_op_t;
+
+
+/* The size is known rather than counted, walking the queue would leave it
+ * colder than the empty queue of the other class just before the measurement.
+ */
+static bool setup_queue(dut_arg_t *arg)
+{
+    pool_carve(arg->n);
+    arg->size = arg->n;
+    return true;
+}
+
+static void run_insert_head(dut_arg_t *arg)
+{
+    arg->ret = q_insert_head(l, arg->s);
+}
+
+static void run_insert_tail(dut_arg_t *arg)
+{
+    arg->ret = q_insert_tail(l, arg->s);
+}
+
+static bool check_insert(dut_arg_t *arg, bool tail)
+{
+    return arg->ret && q_size(l) == arg->size + 1 &&
+           pool_undo_insert(arg->n, tail);
+}
+
+static bool check_insert_head(dut_arg_t *arg)
+{
+    return check_insert(arg, false);
+}
+
+static bool check_insert_tail(dut_arg_t *arg)
+{
+    return check_insert(arg, true);
+}
+
+static void run_remove_head(dut_arg_t *arg)
+{
+    arg->e = q_remove_head(l, NULL, 0);
+}
+
+static void run_remove_tail(dut_arg_t *arg)
+{
+    arg->e = q_remove_tail(l, NULL, 0);
+}
+
+static bool check_remove(dut_arg_t *arg, bool tail)
+{
+    if (!arg->e || q_size(l) != arg->size - 1) {
+        if (arg->e)
+            q_release_element(arg->e);
+        return false;
+    }
+    return pool_undo_remove(arg->n, arg->e, tail);
+}
+
+static bool check_remove_head(dut_arg_t *arg)
+{
+    return check_remove(arg, false);
+}
+
+static bool check_remove_tail(dut_arg_t *arg)
+{
+    return check_remove(arg, true);
+}
+
+static void run_size(dut_arg_t *arg)
+{
+    arg->ret = q_size(l);
+}
+
+static bool check_size(dut_arg_t *arg)
+{
+    return arg->ret == arg->n && pool_restore(arg->n);
+}
+
+static void run_delete_mid(dut_arg_t *arg)
+{
+    arg->ret = q_delete_mid(l);
+}
+
+/* The middle element was freed, so put a new one in its place */
+static bool check_delete_mid(dut_arg_t *arg)
+{
+    int n = arg->n, mid = n / 2;
+    struct list_head *prev = mid ? &pool[mid - 1]->list : l;
+    struct list_head *next = mid + 1 < n ? &pool[mid + 1]->list : l;
+    if (!arg->ret || q_size(l) != n - 1 || prev->next != next)
+        return pool_discard(n);
+
+    element_t *e = malloc(sizeof(element_t));
+    if (!e)
+        return pool_discard(n);
+    e->value = strdup(get_random_string());
+    if (!e->value) {
+        free(e);
+        return pool_discard(n);
+    }
+    list_add(&e->list, prev);
+    pool[mid] = e;
+    return pool_restore(n);
+}
+
+static void run_swap(dut_arg_t *arg)
+{
+    q_swap(l);
+}
+
+static int perm_swap(int i, int n)
+{
+    return (i ^ 1) < n ? i ^ 1 : i;
+}
+
+static bool check_swap(dut_arg_t *arg)
+{
+    return pool_unpermute(arg->n, perm_swap);
+}
+
+static void run_reverse(dut_arg_t *arg)
+{
+    q_reverse(l);
+}
+
+static int perm_reverse(int i, int n)
+{
+    return n - 1 - i;
+}
+
+static bool check_reverse(dut_arg_t *arg)
+{
+    return pool_unpermute(arg->n, perm_reverse);
+}
+
+#define DUT_OP(op, cplx, min)                                         \
+    [DUT(op)] = {                                                     \
+        .name = #op,                                                  \
+        .expect = cplx,                                               \
+        .min_size = min,                                              \
+        .setup = setup_queue,                                         \
+        .run = run_##op,                                              \
+        .check = check_##op,                                          \
+    }
+
+static const dut_op_t dut_ops[N_DUT] = {
+    DUT_OP(insert_head, CPLX_1, 0),
+    DUT_OP(insert_tail, CPLX_1, 0),
+    DUT_OP(remove_head, CPLX_1, 1),
+    DUT_OP(remove_tail, CPLX_1, 1),
+    DUT_OP(size, CPLX_N, 0),
+    DUT_OP(delete_mid, CPLX_N, 1),
+    DUT_OP(swap, CPLX_N, 0),
+    DUT_OP(reverse, CPLX_N, 0),
+};
+
+const char *dut_name(int mode)
+{
+    return dut_ops[mode].name;
+}
+
+complexity_t dut_expect(int mode)
+{
+    return dut_ops[mode].expect;
+}
+
+int find_dut(const char *name)
+{
+    for (int i = 0; i < N_DUT; i++) {
+        if (!strcmp(dut_ops[i].name, name))
+            return i;
+    }
+    return -1;
+}
+
+const char *complexity_name(complexity_t cplx)
+{
+    static const char *names[] = {
+        [CPLX_1] = "O(1)",
+        [CPLX_LOG_N] = "O(log n)",
+        [CPLX_N] = "O(n)",
+        [CPLX_N_LOG_N] = "O(n log n)",
+        [CPLX_N2] = "O(n^2)",
+    };
+    return names[cplx];
+}
+
+static inline int queue_size(const uint8_t *input_data, size_t i)
+{
+    return *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000;
+}
+
 bool measure(int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
              int mode)
 {
-    assert(mode == DUT(insert_head) || mode == DUT(insert_tail) ||
-           mode == DUT(remove_head) || mode == DUT(remove_tail));
-
-    switch (mode) {
-    case DUT(insert_head):
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            dut_insert_head(s, 1);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            dut_free();
-            if (before_size != after_size - 1)
-                return false;
-        }
-        break;
-    case DUT(insert_tail):
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            dut_free();
-            if (before_size != after_size - 1)
-                return false;
-        }
-        break;
-    case DUT(remove_head):
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            element_t *e = q_remove_head(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            if (e)
-                q_release_element(e);
-            dut_free();
-            if (before_size != after_size + 1)
-                return false;
-        }
-        break;
-    case DUT(remove_tail):
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            element_t *e = q_remove_tail(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            if (e)
-                q_release_element(e);
-            dut_free();
-            if (before_size != after_size + 1)
-                return false;
-        }
-        break;
-    default:
-        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_size(1);
-            after_ticks[i] = cpucycles();
-            dut_free();
-        }
+    assert(mode >= 0 && mode < N_DUT);
+    const dut_op_t *op = &dut_ops[mode];
+
+    if (!l && !pool_build())
+        return false;
+
+    for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
+        dut_arg_t arg = {
+            .n = queue_size(input_data, i) + op->min_size,
+            .s = get_random_string(),
+        };
+        if (!op->setup(&arg))
+            return pool_fail(arg.n);
+        before_ticks[i] = cpucycles_start();
+        op->run(&arg);
+        after_ticks[i] = cpucycles_stop();
+        if (!op->check(&arg))
+            return pool_fail(arg.n);
     }
     return true;
 }
@@ -16,7 +16,11 @@
     _(insert_head) \
     _(insert_tail) \
     _(remove_head) \
-    _(remove_tail)
+    _(remove_tail) \
+    _(size)        \
+    _(delete_mid)  \
+    _(swap)        \
+    _(reverse)
 
 #define DUT(x) DUT_##x
 
@@ -24,9 +28,30 @@ enum {
 #define _(x) DUT(x),
     DUT_FUNCS
 #undef _
+    N_DUT,
 };
 
-void init_dut();
+/* Complexity classes an operation may be expected to have */
+typedef enum {
+    CPLX_1,
+    CPLX_LOG_N,
+    CPLX_N,
+    CPLX_N_LOG_N,
+    CPLX_N2,
+    N_CPLX,
+} complexity_t;
+
+/* Registry of the operations under test, indexed by DUT(x) */
+const char *dut_name(int mode);
+complexity_t dut_expect(int mode);
+
+/* Index of the operation called name, -1 if none */
+int find_dut(const char *name);
+
+const char *complexity_name(complexity_t cplx);
+
+/* Free the queue the calling thread used for measurements */
+void free_dut(void);
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
 bool measure(int64_t *before_ticks,
              int64_t *after_ticks,
@@ -0,0 +1,115 @@
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+#include "../perf.h"
+#include "cpucycles.h"
+
+#ifdef HAVE_TSC
+int cpucycles_backend = CYCLES_TSC;
+#else
+int cpucycles_backend = CYCLES_CLOCK;
+#endif
+
+int64_t cpucycles_overhead = 0;
+
+/* Start and stop pairs timed to calibrate the overhead */
+#define N_CALIBRATE 1000
+
+/* Every thread counts its own events, so the descriptor is per thread and
+ * opened on first use.
+ */
+static __thread int perf_fd = -1;
+static __thread int perf_fd_backend;
+
+static int perf_open(int backend)
+{
+#ifdef __linux__
+    return perf_counter_open(PERF_TYPE_HARDWARE,
+                             backend == CYCLES_PERF
+                                 ? PERF_COUNT_HW_CPU_CYCLES
+                                 : PERF_COUNT_HW_INSTRUCTIONS);
+#else
+    return -1;
+#endif
+}
+
+int64_t cpucycles_perf(void)
+{
+    if (perf_fd < 0 || perf_fd_backend != cpucycles_backend) {
+        if (perf_fd >= 0)
+            close(perf_fd);
+        perf_fd = perf_open(cpucycles_backend);
+        perf_fd_backend = cpucycles_backend;
+        if (perf_fd < 0)
+            return 0;
+    }
+
+    uint64_t val;
+    if (read(perf_fd, &val, sizeof(val)) != sizeof(val))
+        return 0;
+    return val;
+}
+
+int64_t cpucycles_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The smallest of the empty measurements, so that subtracting it leaves no
+ * measurement negative in the usual case.
+ */
+static int64_t calibrate(void)
+{
+    int64_t min = INT64_MAX;
+    for (int i = 0; i < N_CALIBRATE; i++) {
+        int64_t before = cpucycles_start();
+        int64_t after = cpucycles_stop();
+        if (after - before < min)
+            min = after - before;
+    }
+    return min;
+}
+
+bool cpucycles_select(int backend)
+{
+    switch (backend) {
+    case CYCLES_TSC:
+#ifndef HAVE_TSC
+        return false;
+#endif
+        break;
+    case CYCLES_PERF:
+    case CYCLES_INSTRUCTIONS: {
+        int fd = perf_open(backend);
+        if (fd < 0)
+            return false;
+        close(fd);
+        break;
+    }
+    case CYCLES_CLOCK:
+        break;
+    default:
+        return false;
+    }
+
+    cpucycles_backend = backend;
+    cpucycles_overhead = calibrate();
+    return true;
+}
+
+const char *cpucycles_name(int backend)
+{
+    static const char *names[N_CYCLES] = {
+        [CYCLES_TSC] = "fenced TSC",
+        [CYCLES_PERF] = "perf_event cycles",
+        [CYCLES_INSTRUCTIONS] = "perf_event instructions",
+        [CYCLES_CLOCK] = "clock_gettime nanoseconds",
+    };
+    return backend >= 0 && backend < N_CYCLES ? names[backend] : "unknown";
+}
@@ -1,16 +1,54 @@
 #ifndef DUDECT_CPUCYCLES_H
 #define DUDECT_CPUCYCLES_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#if defined(__i386__) || defined(__x86_64__) || defined(__aarch64__)
+#define HAVE_TSC 1
+#endif
+
+/* Counters which cpucycles_start() and cpucycles_stop() can read */
+typedef enum {
+    CYCLES_TSC,          /* Fenced time stamp counter */
+    CYCLES_PERF,         /* Core cycles of the thread from perf_event */
+    CYCLES_INSTRUCTIONS, /* Retired instructions of the thread */
+    CYCLES_CLOCK,        /* Nanoseconds of clock_gettime() */
+    N_CYCLES,
+} cycles_backend_t;
+
+/* Selected counter, see cpucycles_select() */
+extern int cpucycles_backend;
+
+/* Ticks counted by a start immediately followed by a stop, to be subtracted
+ * from every measurement.
+ */
+extern int64_t cpucycles_overhead;
+
+/* Select backend and calibrate its overhead. Return false, keeping the
+ * previous backend, if it is not available on this machine, e.g. when
+ * perf_event_paranoid forbids counting.
+ */
+bool cpucycles_select(int backend);
+
+const char *cpucycles_name(int backend);
+
+int64_t cpucycles_perf(void);
+int64_t cpucycles_clock(void);
+
 // http://www.intel.com/content/www/us/en/embedded/training/ia-32-ia-64-benchmark-code-execution-paper.html
-static inline int64_t cpucycles(void)
+/* Both ends are fenced, so that the measured code neither starts before the
+ * first read of the counter nor is still in flight at the second one.
+ */
+static inline int64_t cpucycles_start(void)
 {
+    if (cpucycles_backend != CYCLES_TSC)
+        return cpucycles_backend == CYCLES_CLOCK ? cpucycles_clock()
+                                                 : cpucycles_perf();
 #if defined(__i386__) || defined(__x86_64__)
     unsigned int hi, lo;
-    __asm__ volatile("rdtsc\n\t" : "=a"(lo), "=d"(hi));
+    __asm__ volatile("lfence\n\trdtsc\n\tlfence" : "=a"(lo), "=d"(hi)::"memory");
     return ((int64_t) lo) | (((int64_t) hi) << 32);
-
 #elif defined(__aarch64__)
     uint64_t val;
     /* According to ARM DDI 0487F.c, from Armv8.0 to Armv8.5 inclusive, the
@@ -19,10 +57,30 @@ static inline int64_t cpucycles(void)
      * bits wide and it is attributed with the flag 'cap_user_time_short'
      * is true.
      */
-    asm volatile("mrs %0, cntvct_el0" : "=r"(val));
+    asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val)::"memory");
+    return val;
+#else
+    return 0;
+#endif
+}
+
+static inline int64_t cpucycles_stop(void)
+{
+    if (cpucycles_backend != CYCLES_TSC)
+        return cpucycles_backend == CYCLES_CLOCK ? cpucycles_clock()
+                                                 : cpucycles_perf();
+#if defined(__i386__) || defined(__x86_64__)
+    /* rdtscp waits for the preceding instructions to complete */
+    unsigned int hi, lo, aux;
+    __asm__ volatile("rdtscp\n\tlfence"
+                     : "=a"(lo), "=d"(hi), "=c"(aux)::"memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val)::"memory");
     return val;
 #else
-#error Unsupported Architecture
+    return 0;
 #endif
 }
 
@@ -24,33 +24,118 @@
  *
  *  - as long as any of the different test fails, the code will be deemed
  *    variable time.
+ *
+ *  - the cropping thresholds and the class means of the second order test
+ *    come from an initial batch of measurements, which is not tested.
+ *
+ *  - a try stops as soon as a test fails with overwhelming probability, or
+ *    once the t value of every test is so small that it would stay well
+ *    below the threshold even with the full number of measurements.
+ *
+ *  - batches of measurements are independent, so they may be taken by
+ *    several worker threads, each pinned to its own CPU so that cycle counts
+ *    come from one core. Every worker keeps its own statistics, which are
+ *    merged after each round of batches.
  */
 
+/* In the case that are compiling on linux, we need to define _GNU_SOURCE
+ * to have sched_setaffinity and the CPU_* macros.
+ */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "../console.h"
+#include "../logger.h"
 #include "../random.h"
 
 #include "constant.h"
+#include "cpucycles.h"
 #include "fixture.h"
 #include "ttest.h"
 
 #define ENOUGH_MEASURE 10000
 #define TEST_TRIES 10
 
+/* Number of percentile-cropped tests */
+#define N_PERCENTILES 100
+
+/* Tests on uncropped, cropped and second order statistics, in this order */
+#define N_TESTS (N_PERCENTILES + 2)
+#define T_SECOND_ORDER (N_PERCENTILES + 1)
+
+/* Fewest measurements a test needs to be taken into account */
+#define ENOUGH_MEASURE_TEST (ENOUGH_MEASURE / 10)
+
 static t_context_t *t;
 
+/* Taken from the initial batch of a try, read by every worker */
+static bool sampled;
+static int64_t percentiles[N_PERCENTILES];
+static double sample_mean[2];
+
+/* Pseudo mode making the workers free their queues */
+#define MODE_RELEASE -1
+
+int dudect_workers = 1;
+
 /* threshold values for Welch's t-test */
 enum {
     t_threshold_bananas = 500, /* Test failed with overwhelming probability */
     t_threshold_moderate = 10, /* Test failed */
 };
 
+/* Outcome of a try so far */
+typedef enum {
+    LEAK_FOUND,   /* Definitely not constant time */
+    LEAK_UNKNOWN, /* Keep measuring */
+    LEAK_NONE,    /* Maybe constant time */
+} verdict_t;
+
+/* Measurement buffers and statistics of a worker */
+typedef struct {
+    pthread_t thread;
+    int id;
+    unsigned long round; /* Last round seen by the worker */
+    t_context_t t[N_TESTS];
+    bool ok; /* Every measured operation behaved */
+    int64_t *before_ticks;
+    int64_t *after_ticks;
+    int64_t *exec_times;
+    uint8_t *classes;
+    uint8_t *input_data;
+} worker_t;
+
+/* Worker threads, waiting for the main thread to start a round of batches */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned long round; /* Incremented to start a round */
+    int mode;
+    int active;  /* Workers taking part in the current round */
+    int pending; /* Workers which have not finished the current round */
+    bool quit;
+    int workers; /* Number of initialized workers */
+    int size;    /* Number of threads, 0 when measuring in the main thread */
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static worker_t workers[MAX_WORKERS];
+
 static void __attribute__((noreturn)) die(void)
 {
     exit(111);
@@ -61,10 +146,12 @@ static void differentiate(int64_t *exec_times,
                           const int64_t *after_ticks)
 {
     for (size_t i = 0; i < N_MEASURES; i++)
-        exec_times[i] = after_ticks[i] - before_ticks[i];
+        exec_times[i] = after_ticks[i] - before_ticks[i] - cpucycles_overhead;
 }
 
-static void update_statistics(const int64_t *exec_times, uint8_t *classes)
+static void update_statistics(t_context_t *ctx,
+                              const int64_t *exec_times,
+                              uint8_t *classes)
 {
     for (size_t i = 0; i < N_MEASURES; i++) {
         int64_t difference = exec_times[i];
@@ -73,25 +160,102 @@ static void update_statistics(const int64_t *exec_times, uint8_t *classes)
             continue;
 
         /* do a t-test on the execution time */
-        t_push(t, difference, classes[i]);
+        t_push(&ctx[0], difference, classes[i]);
+
+        /* do a t-test on cropped execution times, for several cropping
+         * thresholds.
+         */
+        for (int crop = N_PERCENTILES - 1;
+             crop >= 0 && difference < percentiles[crop]; crop--)
+            t_push(&ctx[crop + 1], difference, classes[i]);
+
+        /* do a second-order test, on the square of the distance to the mean
+         * of the class in the initial batch.
+         */
+        double centered = difference - sample_mean[classes[i]];
+        t_push(&ctx[T_SECOND_ORDER], centered * centered, classes[i]);
     }
 }
 
-static bool report(void)
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Set the cropping thresholds, so that test i + 1 keeps the fastest
+ * 1 - 0.5^(10 (i + 1) / N_PERCENTILES) of the measurements, and the class
+ * means from the first batch of each of n workers.
+ */
+static void prepare_sample(const worker_t *w, int n)
 {
-    double max_t = fabs(t_compute(t));
+    int64_t *sample = malloc(n * N_MEASURES * sizeof(int64_t));
+    if (!sample)
+        die();
+
+    size_t size = 0;
+    double sum[2] = {0, 0}, cnt[2] = {0, 0};
+    for (int k = 0; k < n; k++) {
+        for (size_t i = 0; i < N_MEASURES; i++) {
+            int64_t difference = w[k].exec_times[i];
+            if (difference <= 0)
+                continue;
+            sample[size++] = difference;
+            sum[w[k].classes[i]] += difference;
+            cnt[w[k].classes[i]]++;
+        }
+    }
+
+    qsort(sample, size, sizeof(int64_t), cmp_int64);
+    for (int i = 0; i < N_PERCENTILES; i++) {
+        double which = 1 - pow(0.5, 10 * (double) (i + 1) / N_PERCENTILES);
+        percentiles[i] = size ? sample[(size_t) (which * size)] : 0;
+    }
+    for (int class = 0; class < 2; class ++)
+        sample_mean[class] = cnt[class] ? sum[class] / cnt[class] : 0;
+    free(sample);
+    sampled = true;
+}
+
+/* Largest t value of the tests with enough measurements. A leak makes t
+ * grow like the square root of the number of measurements, so *extrapolated
+ * is the largest t value any of them would reach with ENOUGH_MEASURE.
+ */
+static double max_t_family(double *extrapolated)
+{
+    double max_t = 0;
+    *extrapolated = 0;
+    for (int i = 0; i < N_TESTS; i++) {
+        double n = t[i].n[0] + t[i].n[1];
+        if (n < ENOUGH_MEASURE_TEST || !t[i].n[0] || !t[i].n[1])
+            continue;
+        double x = fabs(t_compute(&t[i]));
+        if (x > max_t)
+            max_t = x;
+        if (n < ENOUGH_MEASURE)
+            x *= sqrt(ENOUGH_MEASURE / n);
+        if (x > *extrapolated)
+            *extrapolated = x;
+    }
+    return max_t;
+}
+
+static verdict_t report(void)
+{
+    double extrapolated;
+    double max_t = max_t_family(&extrapolated);
     double number_traces_max_t = t->n[0] + t->n[1];
     double max_tau = max_t / sqrt(number_traces_max_t);
 
     printf("\033[A\033[2K");
     printf("meas: %7.2lf M, ", (number_traces_max_t / 1e6));
-    if (number_traces_max_t < ENOUGH_MEASURE) {
+    if (number_traces_max_t < ENOUGH_MEASURE / 2) {
         printf("not enough measurements (%.0f still to go).\n",
                ENOUGH_MEASURE - number_traces_max_t);
-        return false;
+        return max_t > t_threshold_bananas ? LEAK_FOUND : LEAK_UNKNOWN;
     }
 
-    /* max_t: the t statistic value
+    /* max_t: the largest t statistic value of the tests
      * max_tau: a t value normalized by sqrt(number of measurements).
      *          this way we can compare max_tau taken with different
      *          number of measurements. This is sort of "distance
@@ -106,72 +270,270 @@ static bool report(void)
 
     /* Definitely not constant time */
     if (max_t > t_threshold_bananas)
-        return false;
+        return LEAK_FOUND;
 
     /* Probably not constant time. */
     if (max_t > t_threshold_moderate)
-        return false;
+        return LEAK_UNKNOWN;
 
     /* For the moment, maybe constant time. */
-    return true;
+    if (number_traces_max_t >= ENOUGH_MEASURE)
+        return LEAK_NONE;
+
+    /* Stop early if every test would stay below half the threshold even with
+     * all the measurements
+     */
+    if (extrapolated < t_threshold_moderate / 2)
+        return LEAK_NONE;
+    return LEAK_UNKNOWN;
+}
+
+/* Take one batch of measurements into the statistics of worker w */
+static void doit(worker_t *w, int mode)
+{
+    prepare_inputs(w->input_data, w->classes);
+
+    w->ok &= measure(w->before_ticks, w->after_ticks, w->input_data, mode);
+    differentiate(w->exec_times, w->before_ticks, w->after_ticks);
+    if (sampled)
+        update_statistics(w->t, w->exec_times, w->classes);
+}
+
+static void worker_run(worker_t *w, int mode)
+{
+    if (mode == MODE_RELEASE)
+        free_dut();
+    else
+        doit(w, mode);
 }
 
-static bool doit(int mode)
+static void worker_init(worker_t *w, int id)
 {
-    int64_t *before_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
-    int64_t *after_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
-    int64_t *exec_times = calloc(N_MEASURES, sizeof(int64_t));
-    uint8_t *classes = calloc(N_MEASURES, sizeof(uint8_t));
-    uint8_t *input_data = calloc(N_MEASURES * CHUNK_SIZE, sizeof(uint8_t));
+    w->id = id;
+    w->ok = true;
+    for (int i = 0; i < N_TESTS; i++)
+        t_init(&w->t[i]);
+    w->before_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
+    w->after_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
+    w->exec_times = calloc(N_MEASURES, sizeof(int64_t));
+    w->classes = calloc(N_MEASURES, sizeof(uint8_t));
+    w->input_data = calloc(N_MEASURES * CHUNK_SIZE, sizeof(uint8_t));
 
-    if (!before_ticks || !after_ticks || !exec_times || !classes ||
-        !input_data) {
+    if (!w->before_ticks || !w->after_ticks || !w->exec_times ||
+        !w->classes || !w->input_data) {
         die();
     }
+}
+
+static void worker_release(worker_t *w)
+{
+    free(w->before_ticks);
+    free(w->after_ticks);
+    free(w->exec_times);
+    free(w->classes);
+    free(w->input_data);
+}
+
+/* Pin the calling thread to the id-th CPU it is allowed to run on, wrapping
+ * around when there are more workers than CPUs.
+ */
+static void pin_worker(int id)
+{
+#if defined(__linux__)
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed))
+        return;
+
+    int k = id % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || k--)
+            continue;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+        break;
+    }
+#else
+    (void) id;
+#endif
+}
 
-    prepare_inputs(input_data, classes);
+static void *worker_main(void *arg)
+{
+    worker_t *w = arg;
+    pin_worker(w->id);
 
-    bool ret = measure(before_ticks, after_ticks, input_data, mode);
-    differentiate(exec_times, before_ticks, after_ticks);
-    update_statistics(exec_times, classes);
-    ret &= report();
+    pthread_mutex_lock(&pool.lock);
+    while (true) {
+        while (pool.round == w->round && !pool.quit)
+            pthread_cond_wait(&pool.start, &pool.lock);
+        if (pool.quit)
+            break;
+        w->round = pool.round;
+        if (w->id >= pool.active)
+            continue;
 
-    free(before_ticks);
-    free(after_ticks);
-    free(exec_times);
-    free(classes);
-    free(input_data);
+        int mode = pool.mode;
+        pthread_mutex_unlock(&pool.lock);
+        worker_run(w, mode);
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.pending == 0)
+            pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+static void pool_stop(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = true;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
 
-    return ret;
+    for (int i = 0; i < pool.size; i++)
+        pthread_join(workers[i].thread, NULL);
+    pool.quit = false;
+    pool.size = 0;
+}
+
+/* Get the pool of threads to match dudect_workers, and return the number of
+ * workers.
+ */
+static int pool_resize(void)
+{
+    int n = dudect_workers;
+    if (n < 1)
+        n = 1;
+    if (n > MAX_WORKERS)
+        n = MAX_WORKERS;
+
+    if (n == pool.workers)
+        return n;
+
+    pool_stop();
+    for (int i = 0; i < pool.workers; i++)
+        worker_release(&workers[i]);
+    memset(workers, 0, sizeof(workers));
+
+    for (int i = 0; i < n; i++) {
+        worker_init(&workers[i], i);
+        workers[i].round = pool.round;
+    }
+    pool.workers = n;
+    if (n == 1)
+        return n;
+
+    /* Leave asynchronous signals such as the alarm of the time limit to the
+     * main thread, which is the one able to handle them.
+     */
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGALRM);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main,
+                           &workers[i])) {
+            die();
+        }
+        pool.size++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return n;
+}
+
+/* Run mode on the first n workers and wait for them */
+static void run_workers(int mode, int n)
+{
+    if (!pool.size) {
+        worker_run(&workers[0], mode);
+    } else {
+        pthread_mutex_lock(&pool.lock);
+        pool.mode = mode;
+        pool.active = n;
+        pool.pending = n;
+        pool.round++;
+        pthread_cond_broadcast(&pool.start);
+        while (pool.pending)
+            pthread_cond_wait(&pool.done, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+/* Take n batches of measurements, one per worker, and merge their statistics
+ * into t. Return whether every measured operation behaved.
+ */
+static bool run_round(int mode, int n)
+{
+    run_workers(mode, n);
+
+    bool ok = true;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < N_TESTS; j++) {
+            t_merge(&t[j], &workers[i].t[j]);
+            t_init(&workers[i].t[j]);
+        }
+        ok &= workers[i].ok;
+        workers[i].ok = true;
+    }
+    return ok;
 }
 
 static void init_once(void)
 {
-    init_dut();
-    t_init(t);
+    for (int i = 0; i < N_TESTS; i++)
+        t_init(&t[i]);
+    sampled = false;
 }
 
-static bool test_const(char *text, int mode)
+dut_result_t test_dut(int mode)
 {
-    bool result = false;
-    t = malloc(sizeof(t_context_t));
+    bool result = false, ok = true;
+    t = malloc(N_TESTS * sizeof(t_context_t));
+    int n_workers = pool_resize();
+    int batches = ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1;
+
+    /* Progress is printed directly, after what the logger holds */
+    logger_flush();
+    /* Calibrate again, the overhead depends on the state of the machine */
+    if (!cpucycles_select(cpucycles_backend))
+        cpucycles_select(CYCLES_CLOCK);
+    printf("Timer: %s, overhead %ld\n", cpucycles_name(cpucycles_backend),
+           (long) cpucycles_overhead);
 
     for (int cnt = 0; cnt < TEST_TRIES; ++cnt) {
-        printf("Testing %s...(%d/%d)\n\n", text, cnt, TEST_TRIES);
+        printf("Testing %s...(%d/%d)\n\n", dut_name(mode), cnt, TEST_TRIES);
         init_once();
-        for (int i = 0; i < ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1;
-             ++i)
-            result = doit(mode);
+        ok = run_round(mode, n_workers);
+        prepare_sample(workers, n_workers);
+        for (int i = 0; ok && i < batches; i += n_workers) {
+            int n = batches - i < n_workers ? batches - i : n_workers;
+            ok = run_round(mode, n);
+            verdict_t verdict = report();
+            if (ok && verdict != LEAK_UNKNOWN) {
+                result = verdict == LEAK_NONE;
+                break;
+            }
+        }
         printf("\033[A\033[2K\033[A\033[2K");
-        if (result)
+        /* A misbehaving implementation is not worth another try */
+        if (result || !ok)
             break;
     }
+    run_workers(MODE_RELEASE, n_workers);
     free(t);
-    return result;
+    fflush(stdout);
+
+    if (!ok)
+        return DUT_BROKEN;
+    return result ? DUT_CONSTANT : DUT_NOT_CONSTANT;
 }
 
 #define DUT_FUNC_IMPL(op) \
-    bool is_##op##_const(void) { return test_const(#op, DUT(op)); }
+    bool is_##op##_const(void) { return test_dut(DUT(op)) == DUT_CONSTANT; }
 
 #define _(x) DUT_FUNC_IMPL(x)
 DUT_FUNCS
@@ -4,6 +4,25 @@
 #include <stdbool.h>
 #include "constant.h"
 
+/* Upper bound of dudect_workers */
+#define MAX_WORKERS 64
+
+/* Number of threads taking measurements. With more than one, each of them is
+ * pinned to its own CPU when possible and the main thread only merges their
+ * statistics.
+ */
+extern int dudect_workers;
+
+/* Outcome of a constant time test */
+typedef enum {
+    DUT_CONSTANT,     /* Probably constant time */
+    DUT_NOT_CONSTANT, /* Probably not constant time */
+    DUT_BROKEN,       /* The operation misbehaved */
+} dut_result_t;
+
+/* Test operation DUT(x) of the registry */
+dut_result_t test_dut(int mode);
+
 /* Interface to test if function is constant */
 #define _(x) bool is_##x##_const(void);
 DUT_FUNCS
@@ -47,3 +47,22 @@ void t_init(t_context_t *ctx)
     }
     return;
 }
+
+/* Add the measurements summarized by src to ctx, as if they had been pushed
+ * to ctx one by one. Uses the pairwise update of Chan et al., see
+ * https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance#Parallel_algorithm
+ */
+void t_merge(t_context_t *ctx, const t_context_t *src)
+{
+    for (int class = 0; class < 2; class ++) {
+        double n_a = ctx->n[class], n_b = src->n[class];
+        if (n_b == 0)
+            continue;
+        double n = n_a + n_b;
+        double delta = src->mean[class] - ctx->mean[class];
+        ctx->mean[class] = ctx->mean[class] + delta * n_b / n;
+        ctx->m2[class] =
+            ctx->m2[class] + src->m2[class] + delta * delta * n_a * n_b / n;
+        ctx->n[class] = n;
+    }
+}
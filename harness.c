@@ -2,12 +2,17 @@
 
 #include <setjmp.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "random.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -25,6 +30,9 @@
 /* Value at end of every block */
 #define MAGICFOOTER 0xbeefdead
 
+/* Value at start of every block allocated in guard page mode */
+#define MAGICGUARD 0xdeadfeed
+
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
@@ -41,23 +49,59 @@ typedef struct __block_element {
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* Alignment malloc guarantees, which payloads in guard page mode keep too */
+#define PAYLOAD_ALIGN _Alignof(max_align_t)
+
+/* Blocks are tracked per thread, so that the dudect workers can build and
+ * free their own queues without locking. A block must be freed by the thread
+ * which allocated it.
+ */
+static __thread block_element_t *allocated = NULL;
+static __thread size_t allocated_count = 0;
+
+/* Byte accounting and size histogram of allocated blocks */
+static __thread mem_stat_t mem_stat;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
-static bool cautious_mode = true;
-static bool noallocate_mode = false;
-static bool error_occurred = false;
-static char *error_message = "";
+/* Place blocks against guard pages */
+int guard_mode = 0;
+
+/* Freed guard page mappings, kept inaccessible until their slot is reused */
+static __thread struct {
+    void *base;
+    size_t len;
+} quarantine[GUARD_QUARANTINE_SIZE];
+static __thread size_t quarantine_next = 0;
+static size_t page_size = 0;
+
+/* Modes and exceptions are per thread as well, as web workers run commands
+ * at the same time as the console
+ */
+static __thread bool cautious_mode = true;
+static __thread bool noallocate_mode = false;
+static __thread bool error_occurred = false;
+static __thread char *error_message = "";
 
 static int time_limit = 1;
 
 /* Data for managing exceptions */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+static __thread jmp_buf env;
+static __thread volatile sig_atomic_t jmp_ready = false;
+static __thread bool time_limited = false;
+
+#ifdef __linux__
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/* The SIGALRM of a time limit goes to the thread it limits, where alarm()
+ * would pick any thread
+ */
+static __thread timer_t limit_timer;
+static __thread bool limit_timer_made = false;
+#endif
 
 /* For test_malloc and test_calloc */
 typedef enum {
@@ -70,8 +114,12 @@ typedef enum {
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    if (!fail_probability)
+        return false;
+
+    /* Percent scaled to 32 bits, rounded up so that 100 always fails */
+    const uint64_t scale = ((1ULL << 32) + 99) / 100;
+    return (prng_next() >> 32) < (uint64_t) fail_probability * scale;
 }
 
 /* Find header of block, given its payload.
@@ -86,7 +134,8 @@ static block_element_t *find_header(void *p)
 
     block_element_t *b =
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
-    if (cautious_mode) {
+    /* Blocks in guard page mode are checked by their magic number alone */
+    if (cautious_mode && b->magic_header != MAGICGUARD) {
         /* Make sure this is really an allocated block */
         block_element_t *ab = allocated;
         bool found = false;
@@ -102,7 +151,7 @@ static block_element_t *find_header(void *p)
         }
     }
 
-    if (b->magic_header != MAGICHEADER) {
+    if (b->magic_header != MAGICHEADER && b->magic_header != MAGICGUARD) {
         report_event(
             MSG_ERROR,
             "Attempted to free unallocated or corrupted block.  Address = %p",
@@ -113,6 +162,39 @@ static block_element_t *find_header(void *p)
     return b;
 }
 
+/* Map payload size to its histogram slot, i.e. the bit width of size */
+static inline int size_class(size_t size)
+{
+    if (!size)
+        return 0;
+    int k = sizeof(long) * 8 - __builtin_clzl(size);
+    return k < MEM_HIST_SIZE ? k : MEM_HIST_SIZE - 1;
+}
+
+static inline void account_alloc(size_t size, size_t overhead)
+{
+    int k = size_class(size);
+    mem_stat.hist_total[k]++;
+    mem_stat.hist_live[k]++;
+    mem_stat.alloc_cnt++;
+    mem_stat.current_bytes += size;
+    mem_stat.overhead_bytes += overhead;
+    /* peak_bytes never drops below mark_bytes, so test the latter first */
+    if (mem_stat.current_bytes > mem_stat.mark_bytes) {
+        mem_stat.mark_bytes = mem_stat.current_bytes;
+        if (mem_stat.current_bytes > mem_stat.peak_bytes)
+            mem_stat.peak_bytes = mem_stat.current_bytes;
+    }
+}
+
+static inline void account_free(size_t size, size_t overhead)
+{
+    mem_stat.hist_live[size_class(size)]--;
+    mem_stat.free_cnt++;
+    mem_stat.current_bytes -= size;
+    mem_stat.overhead_bytes -= overhead;
+}
+
 /* Given pointer to block, find its footer */
 static size_t *find_footer(block_element_t *b)
 {
@@ -122,6 +204,70 @@ static size_t *find_footer(block_element_t *b)
     return p;
 }
 
+/* Bytes of the accessible part of a guarded mapping, the header included */
+static size_t guard_span(size_t size)
+{
+    size_t len = sizeof(block_element_t) + PAYLOAD_ALIGN - 1 + size;
+    return (len + page_size - 1) & ~(page_size - 1);
+}
+
+/* The guard page starts at most PAYLOAD_ALIGN - 1 bytes after the payload */
+static unsigned char *guard_page(block_element_t *b)
+{
+    size_t end = (size_t) b + sizeof(block_element_t) + b->payload_size;
+    return (unsigned char *) ((end + page_size - 1) & ~(page_size - 1));
+}
+
+/* Bytes spent on a block besides its payload */
+static size_t block_overhead(block_element_t *b)
+{
+    if (b->magic_header == MAGICGUARD)
+        return guard_span(b->payload_size) + page_size - b->payload_size;
+    return sizeof(block_element_t) + sizeof(size_t);
+}
+
+/* Map a block whose payload is followed by an inaccessible page */
+static block_element_t *guard_alloc(size_t size)
+{
+    if (!page_size)
+        page_size = sysconf(_SC_PAGESIZE);
+
+    size_t span = guard_span(size);
+    unsigned char *base = mmap(NULL, span + page_size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (mprotect(base + span, page_size, PROT_NONE)) {
+        munmap(base, span + page_size);
+        return NULL;
+    }
+
+    /* Keep the payload aligned like malloc would. When size is not a
+     * multiple of PAYLOAD_ALIGN, that leaves a few bytes between its end and
+     * the guard page, where an overrun goes unnoticed: those are not checked.
+     */
+    size_t payload = (size_t) (base + span - size) & ~(PAYLOAD_ALIGN - 1);
+    return (block_element_t *) (payload - sizeof(block_element_t));
+}
+
+/* Revoke access to a guarded block and put it into quarantine */
+static void guard_release(block_element_t *b)
+{
+    size_t span = guard_span(b->payload_size);
+    unsigned char *base = guard_page(b) - span;
+
+    /* Give the pages back but keep the addresses reserved */
+    madvise(base, span, MADV_DONTNEED);
+    mprotect(base, span, PROT_NONE);
+
+    if (quarantine[quarantine_next].base)
+        munmap(quarantine[quarantine_next].base,
+               quarantine[quarantine_next].len);
+    quarantine[quarantine_next].base = base;
+    quarantine[quarantine_next].len = span + page_size;
+    quarantine_next = (quarantine_next + 1) % GUARD_QUARANTINE_SIZE;
+}
+
 static void *alloc(alloc_t alloc_type, size_t size)
 {
     if (noallocate_mode) {
@@ -134,6 +280,7 @@ static void *alloc(alloc_t alloc_type, size_t size)
     }
 
     if (fail_allocation()) {
+        mem_stat.fail_cnt++;
         char *msg_alloc_failure[] = {
             "Malloc returning NULL",
             "Calloc returning NULL",
@@ -143,17 +290,20 @@ static void *alloc(alloc_t alloc_type, size_t size)
     }
 
     block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
+        guard_mode ? guard_alloc(size)
+                   : malloc(size + sizeof(block_element_t) + sizeof(size_t));
     if (!new_block) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
     }
 
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->magic_header = MAGICHEADER;
+    new_block->magic_header = guard_mode ? MAGICGUARD : MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
+    /* The guard page takes the role of the footer */
+    if (!guard_mode)
+        *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
     memset(p, !alloc_type * FILLCHAR, size);
     // cppcheck-suppress nullPointerRedundantCheck
@@ -165,6 +315,7 @@ static void *alloc(alloc_t alloc_type, size_t size)
         allocated->prev = new_block;
     allocated = new_block;
     allocated_count++;
+    account_alloc(size, block_overhead(new_block));
 
     return p;
 }
@@ -198,17 +349,20 @@ void test_free(void *p)
         return;
 
     block_element_t *b = find_header(p);
-    size_t footer = *find_footer(b);
-    if (footer != MAGICFOOTER) {
+    bool guarded = b->magic_header == MAGICGUARD;
+    if (!guarded && *find_footer(b) != MAGICFOOTER) {
         report_event(MSG_ERROR,
                      "Corruption detected in block with address %p when "
                      "attempting to free it",
                      p);
         error_occurred = true;
     }
+    size_t overhead = block_overhead(b);
     b->magic_header = MAGICFREE;
-    *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
+    if (!guarded) {
+        *find_footer(b) = MAGICFREE;
+        memset(p, FILLCHAR, b->payload_size);
+    }
 
     /* Unlink from list */
     block_element_t *bn = b->next;
@@ -220,7 +374,11 @@ void test_free(void *p)
     if (bn)
         bn->prev = bp;
 
-    free(b);
+    account_free(b->payload_size, overhead);
+    if (guarded)
+        guard_release(b);
+    else
+        free(b);
     allocated_count--;
 }
 
@@ -240,8 +398,49 @@ size_t allocation_check()
     return allocated_count;
 }
 
+void get_memory_stat(mem_stat_t *stat)
+{
+    *stat = mem_stat;
+}
+
+void get_alloc_counts(size_t *alloc_cnt, size_t *fail_cnt)
+{
+    *alloc_cnt = mem_stat.alloc_cnt;
+    *fail_cnt = mem_stat.fail_cnt;
+}
+
+void reset_memory_mark()
+{
+    mem_stat.mark_bytes = mem_stat.current_bytes;
+}
+
+void restore_memory_mark(size_t mark)
+{
+    if (mark > mem_stat.mark_bytes)
+        mem_stat.mark_bytes = mark;
+}
+
 /* Implementation of functions for testing */
 
+const char *guard_fault_reason(void *addr)
+{
+    unsigned char *a = addr;
+    for (size_t i = 0; i < GUARD_QUARANTINE_SIZE; i++) {
+        unsigned char *base = quarantine[i].base;
+        if (base && a >= base && a < base + quarantine[i].len)
+            return "access to freed block";
+    }
+
+    for (block_element_t *b = allocated; b; b = b->next) {
+        if (b->magic_header != MAGICGUARD)
+            continue;
+        unsigned char *guard = guard_page(b);
+        if (a >= guard && a < guard + page_size)
+            return "overrun past end of block";
+    }
+    return NULL;
+}
+
 /* Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
  */
@@ -266,6 +465,27 @@ bool error_check()
     return e;
 }
 
+/* Raise SIGALRM in the calling thread after seconds, or cancel it with 0 */
+static void set_alarm(int seconds)
+{
+#ifdef __linux__
+    if (!limit_timer_made && seconds) {
+        struct sigevent sev = {
+            .sigev_notify = SIGEV_THREAD_ID,
+            .sigev_signo = SIGALRM,
+        };
+        sev.sigev_notify_thread_id = syscall(SYS_gettid);
+        limit_timer_made = !timer_create(CLOCK_MONOTONIC, &sev, &limit_timer);
+    }
+    if (limit_timer_made) {
+        struct itimerspec its = {.it_value.tv_sec = seconds};
+        timer_settime(limit_timer, 0, &its, NULL);
+        return;
+    }
+#endif
+    alarm(seconds);
+}
+
 /* Prepare for a risky operation using setjmp.
  * Function returns true for initial return, false for error return
  */
@@ -275,7 +495,7 @@ bool exception_setup(bool limit_time)
         /* Got here from longjmp */
         jmp_ready = false;
         if (time_limited) {
-            alarm(0);
+            set_alarm(0);
             time_limited = false;
         }
 
@@ -288,7 +508,7 @@ bool exception_setup(bool limit_time)
     /* Got here from initial call */
     jmp_ready = true;
     if (limit_time) {
-        alarm(time_limit);
+        set_alarm(time_limit);
         time_limited = true;
     }
     return true;
@@ -298,7 +518,7 @@ bool exception_setup(bool limit_time)
 void exception_cancel()
 {
     if (time_limited) {
-        alarm(0);
+        set_alarm(0);
         time_limited = false;
     }
 
@@ -306,6 +526,15 @@ void exception_cancel()
     error_message = "";
 }
 
+void exception_release()
+{
+#ifdef __linux__
+    if (limit_timer_made)
+        timer_delete(limit_timer);
+    limit_timer_made = false;
+#endif
+}
+
 /* Use longjmp to return to most recent exception setup */
 void trigger_exception(char *msg)
 {
@@ -18,12 +18,77 @@ char *test_strdup(const char *s);
 
 #ifdef INTERNAL
 
-/* Report number of allocated blocks */
+/* Report number of allocated blocks.
+ * Blocks and the statistics below are tracked per thread.
+ */
 size_t allocation_check();
 
+/* Number of payload size classes tracked by the allocation histogram */
+#define MEM_HIST_SIZE 32
+
+/* Memory usage of the blocks handed out by test_malloc and test_calloc.
+ * Byte counts refer to payload sizes, i.e. what the caller asked for.
+ */
+typedef struct {
+    size_t current_bytes;  /* Payload bytes currently allocated */
+    size_t peak_bytes;     /* Maximum of current_bytes over the whole run */
+    size_t mark_bytes;     /* Maximum of current_bytes since last reset */
+    size_t overhead_bytes; /* Header and footer bytes of live blocks */
+    size_t alloc_cnt;      /* Number of successful allocations */
+    size_t free_cnt;       /* Number of blocks freed */
+    size_t fail_cnt;       /* Number of allocations made to fail */
+    /* Slot k counts payloads of size in [2^(k-1), 2^k), slot 0 counts
+     * zero-sized ones and the last slot collects everything larger.
+     */
+    size_t hist_total[MEM_HIST_SIZE];
+    size_t hist_live[MEM_HIST_SIZE];
+} mem_stat_t;
+
+/* Take a snapshot of the memory statistics */
+void get_memory_stat(mem_stat_t *stat);
+
+/* Get only the numbers of allocations made and made to fail, without the
+ * cost of a snapshot
+ */
+void get_alloc_counts(size_t *alloc_cnt, size_t *fail_cnt);
+
+/* Restart high-water mark tracking from the current usage */
+void reset_memory_mark();
+
+/* Resume high-water mark tracking which had reached mark before a reset,
+ * keeping the greater of the two
+ */
+void restore_memory_mark(size_t mark);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Number of freed blocks kept inaccessible in guard page mode */
+#define GUARD_QUARANTINE_SIZE 1024
+
+/*
+ * Guard page mode, like Electric Fence.
+ * When nonzero, each block gets a mapping of its own whose payload ends right
+ * before an inaccessible page, so writing past the end faults immediately
+ * instead of being noticed when the block is freed.  Payloads stay aligned to
+ * max_align_t, so up to alignof(max_align_t) - 1 bytes between the end of a
+ * payload and its guard page are not checked.  Freed blocks are left mapped
+ * without access until GUARD_QUARANTINE_SIZE more blocks have been freed,
+ * which makes most uses after free and double frees fault too.  The list scan
+ * of cautious mode is skipped for these blocks.
+ *
+ * Memory cost: a block takes at least two pages of address space (8 KiB with
+ * 4 KiB pages), one of them resident, and two kernel memory mappings.  With
+ * the default vm.max_map_count of Linux only about 30000 blocks can be live,
+ * so this mode is meant for small traces.
+ */
+extern int guard_mode;
+
+/* Explain a fault at addr caused by guard page mode, NULL if unrelated.
+ * Only reads plain memory, so it may be called from a signal handler.
+ */
+const char *guard_fault_reason(void *addr);
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -47,6 +112,9 @@ bool exception_setup(bool limit_time);
 /* Call once past risky code */
 void exception_cancel();
 
+/* Release what limiting the time took in the calling thread, before it ends */
+void exception_release();
+
 /* Use longjmp to return to most recent exception setup.  Include error message
  */
 void trigger_exception(char *msg);
@@ -0,0 +1,653 @@
+/* Background writer of the output of report(), see logger.h */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+/* Messages gathered into one writev() */
+#define MAX_IOV 1024
+
+/* Files written in one pass over the ring. Each report() goes to the output
+ * and the log, so messages to both alternate.
+ */
+#define MAX_FILES 4
+
+/* The writer is woken once the ring is this full, or else writes what it
+ * holds at most this late, so that waking it does not cost more than
+ * writing each message would
+ */
+#define WAKE_BYTES (ring_size / 8)
+#define DRAIN_NS 10000000
+
+/* Header of a message in the ring, followed by its text. Records are
+ * aligned to the size of the header, so one always fits before the end.
+ */
+typedef struct {
+    uint32_t len;
+    int32_t fd; /* -1 for the padding before the end of the ring */
+} record_t;
+
+#define REC_ALIGN sizeof(record_t)
+#define REC_SIZE(len) \
+    ((sizeof(record_t) + (len) + REC_ALIGN - 1) & ~(REC_ALIGN - 1))
+
+static char *ring = NULL;
+static size_t ring_size; /* A power of 2 */
+
+/* Bytes ever published by the producer and written out by the writer, so
+ * that head - tail is what the ring holds
+ */
+static atomic_size_t head, tail;
+
+static logger_policy_t policy;
+static uint64_t dropped = 0;
+
+/* The one thread putting messages into the ring and using the formats of the
+ * binary log, which started the writer or the log
+ */
+static pthread_t producer;
+
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t data_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+
+/* Set while the writer waits for data, and the producer for space */
+static atomic_bool writer_waiting, producer_waiting;
+static atomic_bool stopping;
+
+/* Wait for the writer until enough is buffered, or it is wanted at once */
+static void writer_wait(size_t t)
+{
+    struct timespec deadline;
+    bool timed = false;
+    pthread_mutex_lock(&lock);
+    atomic_store(&writer_waiting, true);
+    while (!atomic_load(&stopping) && !atomic_load(&producer_waiting)) {
+        size_t pending = atomic_load(&head) - t;
+        if (pending >= WAKE_BYTES)
+            break;
+        if (!pending) {
+            pthread_cond_wait(&data_cond, &lock);
+            continue;
+        }
+        if (!timed) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += DRAIN_NS;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            timed = true;
+        }
+        if (pthread_cond_timedwait(&data_cond, &lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    atomic_store(&writer_waiting, false);
+    pthread_mutex_unlock(&lock);
+}
+
+static void wake_writer(void)
+{
+    pthread_mutex_lock(&lock);
+    pthread_cond_signal(&data_cond);
+    pthread_mutex_unlock(&lock);
+}
+
+static void write_all(int fd, struct iovec *iov, int n)
+{
+    while (n > 0) {
+        ssize_t done = writev(fd, iov, n);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return;
+        while (n > 0 && (size_t) done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+}
+
+/* Messages of a pass over the ring to one file */
+typedef struct {
+    int fd;
+    int n;
+    struct iovec iov[MAX_IOV];
+} batch_t;
+
+static void *writer_main(void *arg)
+{
+    static batch_t batches[MAX_FILES];
+    for (;;) {
+        size_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+        writer_wait(t);
+        size_t h = atomic_load_explicit(&head, memory_order_acquire);
+        if (t == h) {
+            if (atomic_load(&stopping))
+                break;
+            continue;
+        }
+
+        /* The messages to each file in one call, in their order */
+        int n_files = 0;
+        while (t < h) {
+            record_t *r = (record_t *) (ring + (t & (ring_size - 1)));
+            if (r->fd >= 0) {
+                batch_t *b = NULL;
+                for (int i = 0; i < n_files && !b; i++) {
+                    if (batches[i].fd == r->fd)
+                        b = &batches[i];
+                }
+                if (!b) {
+                    if (n_files == MAX_FILES)
+                        break;
+                    b = &batches[n_files++];
+                    b->fd = r->fd;
+                    b->n = 0;
+                }
+                if (b->n == MAX_IOV)
+                    break;
+                b->iov[b->n].iov_base = r + 1;
+                b->iov[b->n++].iov_len = r->len;
+            }
+            t += REC_SIZE(r->len);
+        }
+        for (int i = 0; i < n_files; i++)
+            write_all(batches[i].fd, batches[i].iov, batches[i].n);
+
+        atomic_store(&tail, t);
+        if (atomic_load(&producer_waiting)) {
+            pthread_mutex_lock(&lock);
+            pthread_cond_broadcast(&space_cond);
+            pthread_mutex_unlock(&lock);
+        }
+    }
+    return arg;
+}
+
+static bool is_producer(void)
+{
+    return pthread_equal(pthread_self(), producer);
+}
+
+bool logger_active(void)
+{
+    return ring != NULL && is_producer();
+}
+
+bool logger_start(size_t ring_bytes, logger_policy_t p)
+{
+    if (ring)
+        logger_stop();
+
+    ring_size = 4096;
+    while (ring_size < ring_bytes)
+        ring_size *= 2;
+    ring = malloc(ring_size);
+    if (!ring)
+        return false;
+    atomic_store(&head, 0);
+    atomic_store(&tail, 0);
+    atomic_store(&stopping, false);
+    policy = p;
+    dropped = 0;
+    producer = pthread_self();
+
+    /* Signals, such as the alarm of the time limit, must reach the thread
+     * running the commands
+     */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&writer, NULL, writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        free(ring);
+        ring = NULL;
+        return false;
+    }
+    return true;
+}
+
+/* Wait until the ring holds at most ring_size - room bytes */
+static void wait_room(size_t room)
+{
+    size_t h = atomic_load_explicit(&head, memory_order_relaxed);
+    if (ring_size - (h - atomic_load(&tail)) >= room)
+        return;
+    pthread_mutex_lock(&lock);
+    atomic_store(&producer_waiting, true);
+    pthread_cond_signal(&data_cond);
+    while (ring_size - (h - atomic_load(&tail)) < room)
+        pthread_cond_wait(&space_cond, &lock);
+    atomic_store(&producer_waiting, false);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Wait until what was published when called is written, from a thread other
+ * than the producer, which may keep publishing meanwhile. Only fatal errors
+ * and exit() on such a thread come here.
+ */
+static void drain_published(void)
+{
+    size_t h = atomic_load(&head);
+    while ((ptrdiff_t) (h - atomic_load(&tail)) > 0) {
+        wake_writer();
+        nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+    }
+}
+
+void logger_flush(void)
+{
+    if (!ring)
+        return;
+    if (is_producer())
+        wait_room(ring_size);
+    else
+        drain_published();
+}
+
+void logger_stop(void)
+{
+    if (!ring)
+        return;
+    /* The ring stays for the producer */
+    if (!is_producer()) {
+        drain_published();
+        return;
+    }
+    atomic_store(&stopping, true);
+    wake_writer();
+    pthread_join(writer, NULL);
+    free(ring);
+    ring = NULL;
+}
+
+uint64_t logger_dropped(void)
+{
+    return dropped;
+}
+
+void logger_panic(void)
+{
+    if (!ring)
+        return;
+    size_t t = atomic_load(&tail), h = atomic_load(&head);
+    while ((ptrdiff_t) (h - t) > 0) {
+        record_t *r = (record_t *) (ring + (t & (ring_size - 1)));
+        if (r->fd >= 0) {
+            ssize_t n = write(r->fd, r + 1, r->len);
+            (void) n;
+        }
+        t += REC_SIZE(r->len);
+    }
+    atomic_store(&tail, t);
+}
+
+/* Room for a message of len bytes, after padding up to the end of the ring
+ * if it does not fit before. NULL when it is dropped.
+ */
+static record_t *reserve(size_t len)
+{
+    size_t need = REC_SIZE(len);
+    size_t h = atomic_load_explicit(&head, memory_order_relaxed);
+    size_t pos = h & (ring_size - 1);
+    size_t pad = ring_size - pos < need ? ring_size - pos : 0;
+    if (ring_size - (h - atomic_load(&tail)) < pad + need) {
+        if (policy == LOGGER_DROP) {
+            dropped++;
+            return NULL;
+        }
+        wait_room(pad + need);
+    }
+    if (pad) {
+        record_t *r = (record_t *) (ring + pos);
+        r->len = pad - sizeof(record_t);
+        r->fd = -1;
+        atomic_store_explicit(&head, h + pad, memory_order_release);
+        pos = 0;
+    }
+    return (record_t *) (ring + pos);
+}
+
+/* Hand the message in r to the writer */
+static void publish(record_t *r, int fd, size_t len)
+{
+    r->len = len;
+    r->fd = fd;
+    /* Not published before this, a message cut short by a signal handler
+     * which does not return is simply written over
+     */
+    size_t h = atomic_load_explicit(&head, memory_order_relaxed);
+    size_t pending = h - atomic_load(&tail);
+    atomic_store(&head, h + REC_SIZE(len));
+    /* The writer sleeps until there is something, then until there is
+     * enough
+     */
+    if (atomic_load(&writer_waiting) &&
+        (!pending || (pending < WAKE_BYTES &&
+                      pending + REC_SIZE(len) >= WAKE_BYTES)))
+        wake_writer();
+}
+
+/* Whether a message of len bytes is too large for the ring */
+static bool too_large(size_t len)
+{
+    return REC_SIZE(len) > ring_size / 2;
+}
+
+void logger_vprintf(int fd, bool newline, const char *fmt, va_list ap)
+{
+    /* Formatted into what is free before the end of the ring, which mostly
+     * is enough
+     */
+    size_t h = atomic_load_explicit(&head, memory_order_relaxed);
+    size_t pos = h & (ring_size - 1);
+    size_t free_bytes = ring_size - (h - atomic_load(&tail));
+    size_t room = ring_size - pos < free_bytes ? ring_size - pos : free_bytes;
+    room = room > sizeof(record_t) ? room - sizeof(record_t) : 0;
+
+    va_list aq;
+    va_copy(aq, ap);
+    record_t *r = (record_t *) (ring + pos);
+    int n = vsnprintf(room ? (char *) (r + 1) : NULL, room, fmt, aq);
+    va_end(aq);
+    if (n < 0)
+        return;
+    size_t len = n + newline;
+    if ((size_t) n >= room || REC_SIZE(len) > room + sizeof(record_t)) {
+        if (too_large(len + 1)) {
+            /* Written directly, after what is before it */
+            char *buf = malloc(len + 1);
+            if (!buf)
+                return;
+            va_copy(aq, ap);
+            vsnprintf(buf, len + 1, fmt, aq);
+            va_end(aq);
+            if (newline)
+                buf[n] = '\n';
+            logger_flush();
+            struct iovec iov = {.iov_base = buf, .iov_len = len};
+            write_all(fd, &iov, 1);
+            free(buf);
+            return;
+        }
+        r = reserve(len + 1);
+        if (!r)
+            return;
+        va_copy(aq, ap);
+        vsnprintf((char *) (r + 1), len + 1, fmt, aq);
+        va_end(aq);
+    }
+    if (newline)
+        ((char *) (r + 1))[n] = '\n';
+    publish(r, fd, len);
+}
+
+/* Binary records */
+
+#define BINARY_MAGIC "QLOG"
+#define BINARY_VERSION 1
+
+/* Formats by their address, checked against a hash of their text, as some
+ * are not literals
+ */
+#define N_FORMATS 1024
+
+static struct {
+    const char *fmt;
+    uint32_t hash;
+    uint32_t id;
+} formats[N_FORMATS];
+static atomic_uint n_formats = 0;
+
+void logger_binary_start(int fd)
+{
+    memset(formats, 0, sizeof(formats));
+    atomic_store(&n_formats, 0);
+    producer = pthread_self();
+
+    struct {
+        char magic[4];
+        uint32_t version;
+        uint32_t order; /* 0x01020304 in the byte order of the writer */
+    } header = {BINARY_MAGIC, BINARY_VERSION, 0x01020304};
+    logger_flush();
+    struct iovec iov = {.iov_base = &header, .iov_len = sizeof(header)};
+    write_all(fd, &iov, 1);
+}
+
+static uint32_t fnv1a(const char *s)
+{
+    uint32_t h = 2166136261u;
+    for (; *s; s++)
+        h = (h ^ (unsigned char) *s) * 16777619u;
+    return h;
+}
+
+static size_t format_slot(const char *fmt)
+{
+    return ((uintptr_t) fmt >> 3) % N_FORMATS;
+}
+
+/* Id of fmt, and whether it is the first time it is used */
+static uint32_t format_id(const char *fmt, bool *is_new)
+{
+    uint32_t hash = fnv1a(fmt);
+    size_t slot = format_slot(fmt);
+    *is_new = formats[slot].fmt != fmt || formats[slot].hash != hash;
+    if (*is_new) {
+        formats[slot].fmt = fmt;
+        formats[slot].hash = hash;
+        formats[slot].id = atomic_fetch_add(&n_formats, 1);
+    }
+    return formats[slot].id;
+}
+
+/* Writer of a record into a buffer of cap bytes, which counts what does not
+ * fit, so that a first pass sizes the record
+ */
+typedef struct {
+    char *buf;
+    size_t cap, len;
+} encoder_t;
+
+static void put(encoder_t *e, const void *data, size_t n)
+{
+    if (n && e->len + n <= e->cap)
+        memcpy(e->buf + e->len, data, n);
+    e->len += n;
+}
+
+static void put_u64(encoder_t *e, uint64_t v)
+{
+    put(e, &v, sizeof(v));
+}
+
+/* Encode the arguments of fmt from ap, each integer in 8 bytes, each
+ * floating point number as a double, and each string by its length in 4
+ * bytes and its text
+ */
+static void encode_args(encoder_t *e, const char *fmt, va_list ap)
+{
+    for (const char *p = fmt; *p; p++) {
+        if (*p != '%')
+            continue;
+        p++;
+        if (*p == '%')
+            continue;
+        p += strspn(p, "-+ #0'");
+        int precision = -1;
+        if (*p == '*') {
+            put_u64(e, (uint64_t) (int64_t) va_arg(ap, int));
+            p++;
+        } else {
+            p += strspn(p, "0123456789");
+        }
+        if (*p == '.') {
+            p++;
+            if (*p == '*') {
+                precision = va_arg(ap, int);
+                put_u64(e, (uint64_t) (int64_t) precision);
+                p++;
+            } else {
+                precision = atoi(p);
+                p += strspn(p, "0123456789");
+            }
+        }
+        int longs = 0;
+        char size = 0;
+        for (; *p && strchr("hlLqjzt", *p); p++) {
+            if (*p == 'l' || *p == 'q')
+                longs++;
+            else if (*p != 'h')
+                size = *p;
+        }
+        switch (*p) {
+        case 'd':
+        case 'i':
+            if (size == 'j')
+                put_u64(e, (uint64_t) va_arg(ap, intmax_t));
+            else if (size == 'z')
+                put_u64(e, (uint64_t) va_arg(ap, ssize_t));
+            else if (size == 't')
+                put_u64(e, (uint64_t) va_arg(ap, ptrdiff_t));
+            else if (longs > 1)
+                put_u64(e, (uint64_t) va_arg(ap, long long));
+            else if (longs)
+                put_u64(e, (uint64_t) va_arg(ap, long));
+            else
+                put_u64(e, (uint64_t) (int64_t) va_arg(ap, int));
+            break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            if (size == 'j')
+                put_u64(e, va_arg(ap, uintmax_t));
+            else if (size == 'z')
+                put_u64(e, va_arg(ap, size_t));
+            else if (size == 't')
+                put_u64(e, (uint64_t) va_arg(ap, ptrdiff_t));
+            else if (longs > 1)
+                put_u64(e, va_arg(ap, unsigned long long));
+            else if (longs)
+                put_u64(e, va_arg(ap, unsigned long));
+            else
+                put_u64(e, va_arg(ap, unsigned int));
+            break;
+        case 'c':
+            put_u64(e, (uint64_t) va_arg(ap, int));
+            break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A': {
+            double d = size == 'L' ? (double) va_arg(ap, long double)
+                                   : va_arg(ap, double);
+            put(e, &d, sizeof(d));
+            break;
+        }
+        case 's': {
+            const char *s = va_arg(ap, const char *);
+            if (!s)
+                s = "(null)";
+            uint32_t n = precision >= 0 ? strnlen(s, precision) : strlen(s);
+            put(e, &n, sizeof(n));
+            put(e, s, n);
+            break;
+        }
+        case 'p':
+            put_u64(e, (uint64_t) (uintptr_t) va_arg(ap, void *));
+            break;
+        default:
+            /* Unknown conversion, whose argument cannot be taken */
+            return;
+        }
+    }
+}
+
+/* Encode the message, after the definition of its format if it is new */
+static void encode(encoder_t *e,
+                   uint32_t id,
+                   bool is_new,
+                   bool newline,
+                   const char *fmt,
+                   va_list ap)
+{
+    if (is_new) {
+        uint32_t len = strlen(fmt);
+        put(e, "F", 1);
+        put(e, &id, sizeof(id));
+        put(e, &len, sizeof(len));
+        put(e, fmt, len);
+    }
+    uint8_t nl = newline;
+    put(e, "M", 1);
+    put(e, &id, sizeof(id));
+    put(e, &nl, sizeof(nl));
+    va_list aq;
+    va_copy(aq, ap);
+    encode_args(e, fmt, aq);
+    va_end(aq);
+}
+
+void logger_vrecord(int fd, bool newline, const char *fmt, va_list ap)
+{
+    /* Other threads define the format with each message, under an id of
+     * its own, and write both in one call
+     */
+    bool producing = is_producer();
+    bool is_new = true;
+    uint32_t id = producing ? format_id(fmt, &is_new)
+                            : atomic_fetch_add(&n_formats, 1);
+    encoder_t e = {NULL, 0, 0};
+    encode(&e, id, is_new, newline, fmt, ap);
+    size_t len = e.len;
+
+    if (ring && producing && !too_large(len)) {
+        record_t *r = reserve(len);
+        if (!r) {
+            /* The format goes with the next message using it instead */
+            if (is_new)
+                formats[format_slot(fmt)].fmt = NULL;
+            return;
+        }
+        e = (encoder_t){(char *) (r + 1), len, 0};
+        encode(&e, id, is_new, newline, fmt, ap);
+        publish(r, fd, len);
+        return;
+    }
+
+    char small[1024];
+    e = (encoder_t){len <= sizeof(small) ? small : malloc(len), len, 0};
+    if (!e.buf)
+        return;
+    encode(&e, id, is_new, newline, fmt, ap);
+    if (producing)
+        logger_flush();
+    struct iovec iov = {.iov_base = e.buf, .iov_len = len};
+    write_all(fd, &iov, 1);
+    if (e.buf != small)
+        free(e.buf);
+}
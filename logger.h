@@ -0,0 +1,61 @@
+#ifndef LAB0_LOGGER_H
+#define LAB0_LOGGER_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Output of report() written from a background thread.
+ *
+ * Messages are formatted straight into a ring buffer, which a writer thread
+ * drains with writev(), all the messages buffered for one file in one call.
+ * Only the thread which started the writer, the one running commands, puts
+ * messages into the ring, so the ring needs no lock: the producer publishes
+ * its head and the writer its tail. Other threads, such as the workers of
+ * dudect, write their messages directly. When the ring is full, the producer
+ * either waits for the writer or drops the message and counts it.
+ *
+ * Anything written to a file other than through the logger must be preceded
+ * by logger_flush(), so that it lands after the messages before it.
+ */
+
+typedef enum { LOGGER_BLOCK, LOGGER_DROP } logger_policy_t;
+
+/* Start the writer with a ring of about ring_bytes */
+bool logger_start(size_t ring_bytes, logger_policy_t policy);
+
+/* Write out what is buffered and stop the writer */
+void logger_stop(void);
+
+/* Whether the writer runs and takes the messages of the calling thread */
+bool logger_active(void);
+
+/* Wait until everything buffered is written */
+void logger_flush(void);
+
+/* Number of messages dropped since the writer started */
+uint64_t logger_dropped(void);
+
+/* Write out what is buffered with write() alone, from a signal handler of a
+ * crash. Messages the writer is writing at the time may appear twice.
+ */
+void logger_panic(void);
+
+/* Format a message for file descriptor fd, with a newline if newline */
+void logger_vprintf(int fd, bool newline, const char *fmt, va_list ap);
+
+/* Binary log records, formatted offline by scripts/logfmt.py.
+ *
+ * A log starts with a header. Each message then is its format, by the id it
+ * was given with the first message using it, and its arguments in their C
+ * types. See logfmt.py for the layout.
+ */
+
+/* Write the header of a binary log to fd, and forget the formats sent */
+void logger_binary_start(int fd);
+
+/* Write a message to the binary log on fd, through the writer if it runs */
+void logger_vrecord(int fd, bool newline, const char *fmt, va_list ap);
+
+#endif /* LAB0_LOGGER_H */
@@ -0,0 +1,240 @@
+/* Per command counters and latency histograms, see metrics.h */
+
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "report.h"
+
+struct __cmd_metrics {
+    const char *name;
+    uint64_t runs, failures;
+    uint64_t elements, allocs, alloc_fails;
+    uint64_t sum_ns, max_ns;
+    uint64_t *buckets; /* METRICS_BUCKETS counts, from the first run */
+    struct __cmd_metrics *next;
+};
+
+/* In the order of names, as help lists the commands */
+static cmd_metrics_t *metrics_list = NULL;
+
+/* Held to record or read counts, which web workers update too */
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bounds of the buckets of the exported histograms, 2^k ns for k in this
+ * range. These are bounds of log-linear buckets too, so the counts below
+ * them are exact.
+ */
+#define EXPORT_MIN_SHIFT 10 /* About 1 us */
+#define EXPORT_MAX_SHIFT 34 /* About 17 s */
+
+/* Quantiles estimated from the log-linear buckets */
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+#define N_QUANTILES (sizeof(quantiles) / sizeof(quantiles[0]))
+
+/* Values below METRICS_SUB_BUCKETS have a bucket each. Above, value v with
+ * its highest bit at e goes to sub-bucket v >> (e - METRICS_SUB_BITS) of the
+ * buckets of 2^e.
+ */
+static inline unsigned bucket_of(uint64_t v)
+{
+    if (v < METRICS_SUB_BUCKETS)
+        return v;
+    unsigned e = 63 - __builtin_clzll(v);
+    return (e - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS +
+           (unsigned) (v >> (e - METRICS_SUB_BITS)) - METRICS_SUB_BUCKETS;
+}
+
+/* Largest value that goes to bucket i */
+static uint64_t bucket_max(unsigned i)
+{
+    if (i < METRICS_SUB_BUCKETS)
+        return i;
+    unsigned e = i / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+    uint64_t sub = i % METRICS_SUB_BUCKETS + METRICS_SUB_BUCKETS;
+    uint64_t width = (uint64_t) 1 << (e - METRICS_SUB_BITS);
+    return sub * width + (width - 1);
+}
+
+static void free_metrics(void)
+{
+    while (metrics_list) {
+        cmd_metrics_t *m = metrics_list;
+        metrics_list = m->next;
+        if (m->buckets)
+            free_array(m->buckets, METRICS_BUCKETS, sizeof(uint64_t));
+        free_array(m, 1, sizeof(cmd_metrics_t));
+    }
+}
+
+cmd_metrics_t *metrics_register(const char *name)
+{
+    cmd_metrics_t **loc = &metrics_list;
+    while (*loc && strcmp(name, (*loc)->name) > 0)
+        loc = &(*loc)->next;
+    if (*loc && !strcmp(name, (*loc)->name))
+        return *loc;
+
+    if (!metrics_list)
+        atexit(free_metrics);
+    cmd_metrics_t *m = calloc_or_fail(1, sizeof(cmd_metrics_t), "metrics");
+    m->name = name;
+    m->next = *loc;
+    *loc = m;
+    return m;
+}
+
+void metrics_record(cmd_metrics_t *m, const metrics_sample_t *s)
+{
+    pthread_mutex_lock(&metrics_lock);
+    if (!m->buckets)
+        m->buckets = calloc_or_fail(METRICS_BUCKETS, sizeof(uint64_t),
+                                    "metrics_record");
+    m->runs++;
+    m->failures += !s->ok;
+    m->elements += s->elements;
+    m->allocs += s->allocs;
+    m->alloc_fails += s->alloc_fails;
+    m->sum_ns += s->ns;
+    if (s->ns > m->max_ns)
+        m->max_ns = s->ns;
+    m->buckets[bucket_of(s->ns)]++;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/* Estimate of the q quantile of the latencies of m, the most a latency of
+ * its bucket may be
+ */
+static uint64_t quantile_ns(const cmd_metrics_t *m, double q)
+{
+    /* The run at that rank, counting from 1 */
+    uint64_t rank = (uint64_t) ceil(q * m->runs);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < METRICS_BUCKETS; i++) {
+        seen += m->buckets[i];
+        if (seen >= rank && seen) {
+            uint64_t v = bucket_max(i);
+            return v < m->max_ns ? v : m->max_ns;
+        }
+    }
+    return m->max_ns;
+}
+
+static void put(metrics_vprintf_t out, void *ctx, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    out(ctx, fmt, ap);
+    va_end(ap);
+}
+
+/* A counter of each command, at offset field of its metrics */
+static void put_counter(metrics_vprintf_t out,
+                        void *ctx,
+                        const char *name,
+                        const char *help,
+                        size_t field)
+{
+    put(out, ctx, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (cmd_metrics_t *m = metrics_list; m; m = m->next) {
+        if (m->runs)
+            put(out, ctx, "%s{cmd=\"%s\"} %" PRIu64 "\n", name, m->name,
+                *(uint64_t *) ((char *) m + field));
+    }
+}
+
+void metrics_export(metrics_vprintf_t out, void *ctx)
+{
+    pthread_mutex_lock(&metrics_lock);
+    put_counter(out, ctx, "qtest_commands_total", "Commands run",
+                offsetof(cmd_metrics_t, runs));
+    put_counter(out, ctx, "qtest_command_failures_total", "Commands failed",
+                offsetof(cmd_metrics_t, failures));
+    put_counter(out, ctx, "qtest_command_elements_total",
+                "Queue elements commands built or went through",
+                offsetof(cmd_metrics_t, elements));
+    put_counter(out, ctx, "qtest_command_allocations_total",
+                "Blocks commands allocated through the test harness",
+                offsetof(cmd_metrics_t, allocs));
+    put_counter(out, ctx, "qtest_command_allocation_failures_total",
+                "Allocations of commands the test harness made fail",
+                offsetof(cmd_metrics_t, alloc_fails));
+
+    const char *hist = "qtest_command_duration_seconds";
+    put(out, ctx, "# HELP %s Time commands took\n# TYPE %s histogram\n", hist,
+        hist);
+    for (cmd_metrics_t *m = metrics_list; m; m = m->next) {
+        if (!m->runs)
+            continue;
+        uint64_t below = 0;
+        unsigned i = 0;
+        for (int k = EXPORT_MIN_SHIFT; k <= EXPORT_MAX_SHIFT; k++) {
+            for (; i < bucket_of((uint64_t) 1 << k); i++)
+                below += m->buckets[i];
+            put(out, ctx, "%s_bucket{cmd=\"%s\",le=\"%.9f\"} %" PRIu64 "\n",
+                hist, m->name, (double) ((uint64_t) 1 << k) / 1e9, below);
+        }
+        put(out, ctx, "%s_bucket{cmd=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", hist,
+            m->name, m->runs);
+        put(out, ctx, "%s_sum{cmd=\"%s\"} %.9f\n", hist, m->name,
+            m->sum_ns / 1e9);
+        put(out, ctx, "%s_count{cmd=\"%s\"} %" PRIu64 "\n", hist, m->name,
+            m->runs);
+    }
+
+    const char *quant = "qtest_command_duration_quantile_seconds";
+    put(out, ctx,
+        "# HELP %s Quantiles of the time commands took, from buckets of "
+        "6%% width\n# TYPE %s gauge\n",
+        quant, quant);
+    for (cmd_metrics_t *m = metrics_list; m; m = m->next) {
+        if (!m->runs)
+            continue;
+        for (size_t q = 0; q < N_QUANTILES; q++)
+            put(out, ctx, "%s{cmd=\"%s\",quantile=\"%g\"} %.9f\n", quant,
+                m->name, quantiles[q], quantile_ns(m, quantiles[q]) / 1e9);
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+static void file_vprintf(void *ctx, const char *fmt, va_list ap)
+{
+    vfprintf(ctx, fmt, ap);
+}
+
+bool metrics_write_file(const char *name)
+{
+    FILE *f = fopen(name, "w");
+    if (!f)
+        return false;
+    metrics_export(file_vprintf, f);
+    bool ok = !ferror(f);
+    return fclose(f) == 0 && ok;
+}
+
+void metrics_report(void)
+{
+    pthread_mutex_lock(&metrics_lock);
+    report(1, "%-12s %8s %6s %9s %9s %9s %9s %12s %10s", "cmd", "runs",
+           "fails", "mean", "p50", "p99", "max", "elements", "allocs");
+    for (cmd_metrics_t *m = metrics_list; m; m = m->next) {
+        if (!m->runs)
+            continue;
+        char t[4][32];
+        report(1,
+               "%-12s %8" PRIu64 " %6" PRIu64 " %9s %9s %9s %9s %12" PRIu64
+               " %10" PRIu64,
+               m->name, m->runs, m->failures,
+               format_time(t[0], sizeof(t[0]), (double) m->sum_ns / m->runs),
+               format_time(t[1], sizeof(t[1]), quantile_ns(m, 0.5)),
+               format_time(t[2], sizeof(t[2]), quantile_ns(m, 0.99)),
+               format_time(t[3], sizeof(t[3]), m->max_ns), m->elements,
+               m->allocs);
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
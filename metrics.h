@@ -0,0 +1,48 @@
+#ifndef LAB0_METRICS_H
+#define LAB0_METRICS_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Counters and latency histograms of every console command, exported in the
+ * text format of Prometheus.
+ *
+ * Latencies go to log-linear buckets like those of HdrHistogram: each power
+ * of two is split into METRICS_SUB_BUCKETS equal parts, so that any latency
+ * is known to within 1/METRICS_SUB_BUCKETS of it, from a nanosecond up.
+ */
+
+#define METRICS_SUB_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS ((64 - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+
+typedef struct __cmd_metrics cmd_metrics_t;
+
+/* What one run of a command did */
+typedef struct {
+    uint64_t ns;          /* Time it took */
+    bool ok;              /* Whether it succeeded */
+    uint64_t elements;    /* Queue elements it built or went through */
+    uint64_t allocs;      /* Blocks allocated through the harness */
+    uint64_t alloc_fails; /* Allocations the harness made fail */
+} metrics_sample_t;
+
+/* Get the metrics of command name, creating them the first time */
+cmd_metrics_t *metrics_register(const char *name);
+
+void metrics_record(cmd_metrics_t *m, const metrics_sample_t *s);
+
+/* Write the metrics of the commands which ran, in the text format of
+ * Prometheus, through out
+ */
+typedef void (*metrics_vprintf_t)(void *ctx, const char *fmt, va_list ap);
+void metrics_export(metrics_vprintf_t out, void *ctx);
+
+/* Export to file name, return false if it cannot be written */
+bool metrics_write_file(const char *name);
+
+/* Report a summary line of each command which ran */
+void metrics_report(void);
+
+#endif /* LAB0_METRICS_H */
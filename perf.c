@@ -0,0 +1,132 @@
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "perf.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} perf_events[N_PERF_EVENTS] = {
+    [PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_CACHE_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [PERF_PAGE_FAULTS] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+#endif
+
+/* Open event config of type for the calling thread. A scaled counter starts
+ * disabled and also reads the times it was enabled and running, as more
+ * events than hardware counters are time-shared.
+ */
+static int open_event(uint32_t type, uint64_t config, bool scaled)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = type;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    if (scaled) {
+        attr.disabled = 1;
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    }
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static void enable_event(int fd, bool on)
+{
+#ifdef __linux__
+    ioctl(fd, on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+#endif
+}
+
+int perf_counter_open(uint32_t type, uint64_t config)
+{
+    return open_event(type, config, false);
+}
+
+static long rusage_faults(void)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru))
+        return 0;
+    return ru.ru_minflt + ru.ru_majflt;
+}
+
+int perf_start(perf_counters_t *c)
+{
+    int n = 0;
+    memset(c, 0, sizeof(*c));
+    for (int i = 0; i < N_PERF_EVENTS; i++) {
+#ifdef __linux__
+        c->fd[i] = open_event(perf_events[i].type, perf_events[i].config, true);
+#else
+        c->fd[i] = -1;
+#endif
+        if (c->fd[i] >= 0 && i != PERF_PAGE_FAULTS)
+            n++;
+    }
+    c->faults = rusage_faults();
+
+    /* Enabled last, so that opening the others is not counted */
+    for (int i = 0; i < N_PERF_EVENTS; i++) {
+        if (c->fd[i] >= 0)
+            enable_event(c->fd[i], true);
+    }
+    return n;
+}
+
+void perf_stop(perf_counters_t *c)
+{
+    for (int i = 0; i < N_PERF_EVENTS; i++) {
+        if (c->fd[i] >= 0)
+            enable_event(c->fd[i], false);
+    }
+    long faults = rusage_faults() - c->faults;
+
+    for (int i = 0; i < N_PERF_EVENTS; i++) {
+        /* Count, time enabled, time running */
+        uint64_t buf[3];
+        if (c->fd[i] < 0)
+            continue;
+        if (read(c->fd[i], buf, sizeof(buf)) == sizeof(buf) && buf[2]) {
+            c->count[i] = buf[2] < buf[1]
+                              ? (uint64_t) ((double) buf[0] * buf[1] / buf[2])
+                              : buf[0];
+            c->valid[i] = true;
+        }
+        close(c->fd[i]);
+        c->fd[i] = -1;
+    }
+
+    /* Page faults are also accounted without perf_event */
+    if (!c->valid[PERF_PAGE_FAULTS]) {
+        c->count[PERF_PAGE_FAULTS] = faults;
+        c->valid[PERF_PAGE_FAULTS] = true;
+    }
+}
+
+const char *perf_event_name(perf_event_t event)
+{
+    static const char *names[N_PERF_EVENTS] = {
+        [PERF_CYCLES] = "Cycles",
+        [PERF_INSTRUCTIONS] = "Instructions",
+        [PERF_CACHE_MISSES] = "Cache misses",
+        [PERF_BRANCH_MISSES] = "Branch misses",
+        [PERF_PAGE_FAULTS] = "Page faults",
+    };
+    return names[event];
+}
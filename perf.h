@@ -0,0 +1,40 @@
+#ifndef LAB0_PERF_H
+#define LAB0_PERF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Events counted around a command by perf_start() and perf_stop() */
+typedef enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_PAGE_FAULTS,
+    N_PERF_EVENTS,
+} perf_event_t;
+
+typedef struct {
+    int fd[N_PERF_EVENTS];         /* -1 for the events not permitted */
+    uint64_t count[N_PERF_EVENTS]; /* Counts, scaled when multiplexed */
+    bool valid[N_PERF_EVENTS];
+    long faults; /* Page faults from getrusage() when the event is missing */
+} perf_counters_t;
+
+/* Open a counter of event config of type for the calling thread, enabled
+ * right away. Return -1 where perf_event_open() is unsupported or not
+ * permitted, e.g. by perf_event_paranoid or a container.
+ */
+int perf_counter_open(uint32_t type, uint64_t config);
+
+/* Start counting every event which can be opened, return how many of the
+ * hardware ones were.
+ */
+int perf_start(perf_counters_t *c);
+
+/* Stop counting and fill in the counts */
+void perf_stop(perf_counters_t *c);
+
+const char *perf_event_name(perf_event_t event);
+
+#endif /* LAB0_PERF_H */
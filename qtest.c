@@ -3,6 +3,9 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -19,12 +22,18 @@
 #include <time.h>
 #endif
 
+#include "dudect/complexity.h"
+#include "dudect/cpucycles.h"
 #include "dudect/fixture.h"
 #include "list.h"
+#include "logger.h"
 #include "random.h"
+#include "sort_bench.h"
+#include "trace.h"
 
 /* Shannon entropy */
 extern double shannon_entropy(const uint8_t *input_data);
+extern double shannon_entropy_queue(struct list_head *head, double *out);
 extern int show_entropy;
 
 /* Our program needs to use regular malloc/free */
@@ -46,6 +55,7 @@ extern int show_entropy;
 
 #include "console.h"
 #include "report.h"
+#include "web.h"
 
 /* Settable parameters */
 
@@ -64,17 +74,54 @@ typedef struct {
     int size;
 } queue_chain_t;
 
-static queue_chain_t chain = {.size = 0};
-static queue_contex_t *current = NULL;
+/* Per thread, as web workers run the commands of sessions at the same time
+ * as the console
+ */
+static __thread queue_chain_t chain = {.size = 0};
+static __thread queue_contex_t *current = NULL;
+
+/* Queues of the web clients of a session, apart from those of the console,
+ * session "", and of the other sessions. Those of the active session are
+ * moved into chain, so that commands need not know about sessions.
+ * A session ends with the close command, or once it has been idle for
+ * session_idle seconds when another is started by the same thread.
+ * Only the thread which made a session enters it, as its blocks may only be
+ * freed by the thread which allocated them.
+ */
+#define MAX_SESSIONS 64
+
+typedef struct {
+    char id[WEB_SESSION_LEN + 1];
+    bool used;
+    bool active; /* Entered by its owner */
+    pthread_t owner;
+    uint64_t last_used; /* Time it was last entered, in ns */
+    queue_chain_t chain;
+    queue_contex_t *current;
+} session_t;
+
+static session_t sessions[MAX_SESSIONS] = {
+    [0] = {.used = true, .active = true},
+};
+static int n_sessions = 1; /* Slots ever used */
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread session_t *active_session = NULL;
+static int session_idle = 600;
+
+/* Queues of the sessions of the thread other than the active one */
+static __thread int parked_queues = 0;
 
 /* How many times can queue operations fail */
 static int fail_limit = BIG_LIST_SIZE;
-static int fail_count = 0;
+static __thread int fail_count = 0;
 
 static int string_length = MAXSTRING;
 
 static int descend = 0;
 
+/* Seed of the generator behind RAND strings and malloc failures */
+static int seed = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -85,6 +132,7 @@ typedef enum {
 } position_t;
 /* Forward declarations */
 static bool q_show(int vlevel);
+static int free_queues(struct list_head *head);
 
 static bool do_free(int argc, char *argv[])
 {
@@ -128,7 +176,7 @@ static bool do_free(int argc, char *argv[])
     q_show(3);
 
     size_t bcnt = allocation_check();
-    if (!chain.size && bcnt > 0) {
+    if (!chain.size && !parked_queues && bcnt > 0) {
         report(1,
                "ERROR: There is no queue, but %lu blocks are still allocated",
                bcnt);
@@ -138,6 +186,27 @@ static bool do_free(int argc, char *argv[])
     return ok && !error_check();
 }
 
+static bool do_close(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+    if (active_session == &sessions[0]) {
+        report(1, "ERROR: The console has no session to close");
+        return false;
+    }
+
+    int n = free_queues(&chain.head);
+    chain.size = 0;
+    current = NULL;
+    pthread_mutex_lock(&session_lock);
+    active_session->used = false;
+    pthread_mutex_unlock(&session_lock);
+    report(3, "Session '%s' closed, %d queues freed", active_session->id, n);
+    return !error_check();
+}
+
 static bool do_new(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -168,26 +237,55 @@ static bool do_new(int argc, char *argv[])
  */
 static void fill_rand_string(char *buf, size_t buf_size)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
-
-    uint64_t randstr_buf_64[MAX_RANDSTR_LEN] = {0};
-    randombytes((uint8_t *) randstr_buf_64, len * sizeof(uint64_t));
+    size_t len = MIN_RANDSTR_LEN + prng_below(buf_size - MIN_RANDSTR_LEN);
     for (size_t n = 0; n < len; n++)
-        buf[n] = charset[randstr_buf_64[n] % (sizeof(charset) - 1)];
+        buf[n] = charset[prng_below(sizeof(charset) - 1)];
 
     buf[len] = '\0';
 }
 
+/* Reseed the generator whenever option seed is set */
+static void seed_changed(int oldval)
+{
+    prng_seed(seed);
+}
+
+/* Keep the previous counter when the new one is not available */
+static void timer_changed(int oldval)
+{
+    int backend = cpucycles_backend;
+    cpucycles_backend = oldval;
+    if (!cpucycles_select(backend)) {
+        report(1, "Timer %d (%s) is not available, keeping %s", backend,
+               cpucycles_name(backend), cpucycles_name(oldval));
+        return;
+    }
+    report(1, "Timer: %s, overhead %ld", cpucycles_name(backend),
+           (long) cpucycles_overhead);
+}
+
+/* Whether command argv[0] may be measured in simulation mode. Measuring
+ * takes the whole program, so it is only done from the console thread.
+ */
+static bool can_simulate(int argc, char *argv[])
+{
+    if (web_worker()) {
+        report(1, "%s cannot be measured in a web session", argv[0]);
+        return false;
+    }
+    if (argc != 1) {
+        report(1, "%s does not need arguments in simulation mode", argv[0]);
+        return false;
+    }
+    return true;
+}
+
 /* insertion */
 static bool queue_insert(position_t pos, int argc, char *argv[])
 {
     if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
+        if (!can_simulate(argc, argv))
             return false;
-        }
         bool ok =
             pos == POS_TAIL ? is_insert_tail_const() : is_insert_head_const();
         if (!ok) {
@@ -296,10 +394,8 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
      */
 #if !(defined(__aarch64__) && defined(__APPLE__))
     if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
+        if (!can_simulate(argc, argv))
             return false;
-        }
         bool ok =
             pos == POS_TAIL ? is_remove_tail_const() : is_remove_head_const();
         if (!ok) {
@@ -1101,6 +1197,457 @@ static bool do_show(int argc, char *argv[])
     return q_show(0);
 }
 
+static bool do_simulate(int argc, char *argv[])
+{
+    int mode = argc == 2 ? find_dut(argv[1]) : -1;
+    if (mode < 0) {
+        if (argc == 2)
+            report(1, "Unknown operation '%s'", argv[1]);
+        else
+            report(1, "%s needs 1 argument", argv[0]);
+        report_noreturn(1, "Operations:");
+        for (int i = 0; i < N_DUT; i++)
+            report_noreturn(1, " %s", dut_name(i));
+        report(1, "");
+        return false;
+    }
+
+    complexity_t expect = dut_expect(mode);
+    switch (test_dut(mode)) {
+    case DUT_CONSTANT:
+        report(1, "Probably constant time");
+        return true;
+    case DUT_NOT_CONSTANT:
+        if (expect == CPLX_1) {
+            report(1, "ERROR: Probably not constant time");
+            return false;
+        }
+        report(1, "Probably not constant time, as expected for %s",
+               complexity_name(expect));
+        return true;
+    default:
+        report(1, "ERROR: Wrong implementation of %s", dut_name(mode));
+        return false;
+    }
+}
+
+static bool do_complexity(int argc, char *argv[])
+{
+    int op = argc == 2 || argc == 3 ? find_scaling_op(argv[1]) : -1;
+    int k = 2;
+    if (op < 0 || (argc == 3 && (!get_int(argv[2], &k) || k < 1))) {
+        report(1, "%s needs an operation and, for reverseK, K", argv[0]);
+        report_noreturn(1, "Operations:");
+        for (int i = 0; i < n_scaling_ops(); i++)
+            report_noreturn(1, " %s", scaling_op_name(i));
+        report(1, "");
+        return false;
+    }
+
+    complexity_result_t res;
+    bool ok = false;
+    error_check();
+    /* Checking every free against all blocks would make any operation which
+     * frees elements, and the cleanup, quadratic.
+     */
+    set_cautious_mode(false);
+    if (exception_setup(false))
+        ok = estimate_complexity(op, k, &res);
+    exception_cancel();
+    set_cautious_mode(true);
+    if (!ok) {
+        report(1, "ERROR: Wrong implementation of %s", argv[1]);
+        return false;
+    }
+
+    report(1, "%10s %14s %10s", "n", "cycles", "cycles/n");
+    for (int i = 0; i < COMPLEXITY_N_SIZES; i++)
+        report(1, "%10d %14.0f %10.2f", res.size[i], res.cycles[i],
+               res.cycles[i] / res.size[i]);
+
+    complexity_t expect = scaling_op_expect(op);
+    report(1, "Best fit: %s (R^2 = %.4f), %.0f%% better than %s",
+           complexity_name(res.best), res.r2, res.confidence * 100,
+           complexity_name(res.next));
+    /* n and n log n, like 1 and log n, only differ by a factor of log n,
+     * which the noise of the measurements can account for.
+     */
+    if (res.best > expect + 1) {
+        report(1, "ERROR: Expected %s", complexity_name(expect));
+        return false;
+    }
+    if (res.best > expect)
+        report(1,
+               "Warning: Expected %s, which noisy timings may not separate "
+               "from %s",
+               complexity_name(expect), complexity_name(res.best));
+    return !error_check();
+}
+
+static bool do_sortbench(int argc, char *argv[])
+{
+    int max_size = 100000;
+    if (argc >= 2 &&
+        (!get_int(argv[1], &max_size) || max_size < SORT_BENCH_MIN ||
+         max_size > SORT_BENCH_MAX)) {
+        report(1, "%s needs a size between %d and %d", argv[0],
+               SORT_BENCH_MIN, SORT_BENCH_MAX);
+        return false;
+    }
+    for (int i = 2; i < argc; i++) {
+        if (find_sort_input(argv[i]) < 0) {
+            report(1, "Unknown input '%s'", argv[i]);
+            report_noreturn(1, "Inputs:");
+            for (int j = 0; j < n_sort_inputs(); j++)
+                report_noreturn(1, " %s", sort_input_name(j));
+            report(1, "");
+            return false;
+        }
+    }
+
+    int n_inputs = argc > 2 ? argc - 2 : n_sort_inputs();
+    sort_result_t res[N_SORT_BACKENDS];
+    bool ok = true;
+    error_check();
+    report(1, "%-14s %9s %-11s %12s %12s %10s %7s", "input", "n", "sort",
+           "time", "compares", "/n log2 n", "allocs");
+    /* Freeing millions of elements one by one is too slow with checks */
+    set_cautious_mode(false);
+    for (int i = 0; ok && i < n_inputs; i++) {
+        int input = argc > 2 ? find_sort_input(argv[i + 2]) : i;
+        for (int n = SORT_BENCH_MIN; ok && n <= max_size; n *= 10) {
+            ok = false;
+            if (exception_setup(false))
+                ok = sort_bench(input, n, res);
+            exception_cancel();
+            if (!ok) {
+                report(1, "ERROR: Could not benchmark %s of %d",
+                       sort_input_name(input), n);
+                break;
+            }
+            for (int b = 0; b < N_SORT_BACKENDS; b++) {
+                char buf[32];
+                report(1, "%-14s %9d %-11s %12s %12lu %10.3f %7zu%s",
+                       sort_input_name(input), n, sort_backend_name(b),
+                       format_time(buf, sizeof(buf), res[b].ns),
+                       (unsigned long) res[b].cmps,
+                       res[b].cmps / (n * log2(n)), res[b].allocs,
+                       res[b].sorted ? "" : "  NOT SORTED");
+                ok &= res[b].sorted;
+            }
+        }
+    }
+    set_cautious_mode(true);
+    return ok && !error_check();
+}
+
+/* Buffer of removed strings while replaying */
+static __thread char *replay_buf = NULL;
+static __thread size_t replay_buf_len = 0;
+
+static void replay_buf_free(void)
+{
+    free(replay_buf);
+    replay_buf = NULL;
+    replay_buf_len = 0;
+}
+
+static bool do_compile(int argc, char *argv[])
+{
+    if (argc != 3) {
+        report(1, "%s needs a trace and an output file", argv[0]);
+        return false;
+    }
+    replay_buf_free();
+    return trace_compile(argv[1], argv[2]);
+}
+
+/* Count a failed insertion or removal, which is only an error past the
+ * limit of failures, like for the commands.
+ */
+static bool replay_failed(const char *what, const char *str)
+{
+    fail_count++;
+    if (fail_count < fail_limit) {
+        report(2, "%s%s%s failed", what, *str ? " " : "", str);
+        return true;
+    }
+    report(1, "ERROR: %s%s%s failed (%d failures total)", what,
+           *str ? " " : "", str, fail_count);
+    return false;
+}
+
+/* Run one operation of a compiled trace straight against the queue API,
+ * keeping current->size up to date but leaving out the checks of the
+ * commands.
+ */
+static bool replay_op(const trace_t *t, const trace_op_t *op)
+{
+    struct list_head *q = current->q;
+    char *str = t->strings + op->str;
+    char randstr_buf[MAX_RANDSTR_LEN];
+    element_t *re;
+
+    switch (op->code) {
+    case TRACE_IH:
+    case TRACE_IT:
+        for (int r = 0; r < op->num; r++) {
+            if (op->flags & TRACE_RAND) {
+                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+                str = randstr_buf;
+            }
+            if (op->code == TRACE_IT ? q_insert_tail(q, str)
+                                     : q_insert_head(q, str))
+                current->size++;
+            else if (!replay_failed("Insertion of", str))
+                return false;
+        }
+        return true;
+    case TRACE_RH:
+    case TRACE_RT:
+        if (replay_buf_len < (size_t) string_length + 1) {
+            free(replay_buf);
+            replay_buf_len = string_length + 1;
+            replay_buf = malloc(replay_buf_len);
+            if (!replay_buf) {
+                replay_buf_len = 0;
+                report(1, "INTERNAL ERROR.  Could not allocate space for "
+                          "removed strings");
+                return false;
+            }
+        }
+        re = op->code == TRACE_RT
+                 ? q_remove_tail(q, replay_buf, string_length + 1)
+                 : q_remove_head(q, replay_buf, string_length + 1);
+        if (!re)
+            return replay_failed("Removal from queue", "");
+        q_release_element(re);
+        current->size--;
+        if ((op->flags & TRACE_HAS_STR) &&
+            strncmp(replay_buf, str, string_length)) {
+            report(1, "ERROR: Removed value %s != expected value %s",
+                   replay_buf, str);
+            return false;
+        }
+        return true;
+    case TRACE_SIZE:
+        for (int r = 0; r < op->num; r++) {
+            int cnt = q_size(q);
+            if (cnt != current->size) {
+                report(1,
+                       "ERROR: Computed queue size as %d, but correct value "
+                       "is %d",
+                       cnt, current->size);
+                return false;
+            }
+        }
+        return true;
+    case TRACE_SORT:
+        q_sort(q, descend);
+        return true;
+    case TRACE_REVERSE:
+        q_reverse(q);
+        return true;
+    case TRACE_SWAP:
+        q_swap(q);
+        return true;
+    case TRACE_DEDUP:
+        if (!q_delete_dup(q)) {
+            report(1, "ERROR: Calling delete duplicate on null queue");
+            return false;
+        }
+        current->size = q_size(q);
+        return true;
+    case TRACE_DM: {
+        /* Like dm, which fails along with q_delete_mid */
+        bool ok = q_delete_mid(q);
+        if (!current->size)
+            report(3, "Warning: Try to delete middle node to empty queue");
+        else
+            current->size--;
+        return ok;
+    }
+    case TRACE_ASCEND:
+        current->size = q_ascend(q);
+        return true;
+    case TRACE_DESCEND:
+        current->size = q_descend(q);
+        return true;
+    case TRACE_REVERSEK:
+        q_reverseK(q, op->num);
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Position in the trace, which must survive a longjmp back into replay */
+static __thread volatile uint32_t replay_pos;
+
+static bool do_replay(int argc, char *argv[])
+{
+    bool check = argc == 3 && !strcmp(argv[2], "check");
+    if (argc != 2 && !check) {
+        report(1, "%s needs a compiled trace and optionally 'check'",
+               argv[0]);
+        return false;
+    }
+
+    trace_t t;
+    if (!trace_load(argv[1], &t))
+        return false;
+    char **words = malloc((t.header.max_argc + 1) * sizeof(char *));
+    if (!words) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for replay");
+        trace_free(&t);
+        return false;
+    }
+
+    /* Runs of queue operations share one exception handler, installed by
+     * the first of them and cancelled before the console runs a command.
+     * Frees are not checked against every block, which would make draining
+     * a big queue quadratic.
+     */
+    bool ok = true, guarded = false;
+    error_check();
+    for (replay_pos = 0; replay_pos < t.header.n_ops; replay_pos++) {
+        const trace_op_t *op = &t.ops[replay_pos];
+        bool direct = !check && op->code != TRACE_CMD && !simulation &&
+                      current && current->q;
+        if (!direct) {
+            if (guarded) {
+                exception_cancel();
+                set_cautious_mode(true);
+                guarded = false;
+            }
+            trace_argv(&t, op, words);
+            ok = run_cmd(op->argc, words);
+        } else {
+            if (!guarded) {
+                set_cautious_mode(false);
+                if (!exception_setup(false)) {
+                    ok = false;
+                    break;
+                }
+                guarded = true;
+            }
+            ok = replay_op(&t, op) && !error_check();
+        }
+        if (!ok)
+            break;
+    }
+    if (guarded || !ok) {
+        exception_cancel();
+        set_cautious_mode(true);
+    }
+
+    if (!ok) {
+        trace_argv(&t, &t.ops[replay_pos], words);
+        report_noreturn(1, "ERROR: Replay stopped at command %u:",
+                        replay_pos + 1);
+        for (int i = 0; i < t.ops[replay_pos].argc; i++)
+            report_noreturn(1, " %s", words[i]);
+        report(1, "");
+    } else {
+        report(2, "Replayed %u commands", t.header.n_ops);
+    }
+    free(words);
+    trace_free(&t);
+    q_show(3);
+    return ok;
+}
+
+static bool do_entropy(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling entropy on null queue");
+        return false;
+    }
+
+    /* One value is written per node, whatever q_size() says */
+    int cnt = 0;
+    struct list_head *node;
+    list_for_each (node, current->q)
+        cnt++;
+    double *values = cnt ? malloc(cnt * sizeof(double)) : NULL;
+    if (cnt && !values) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for entropy");
+        return false;
+    }
+
+    double total = shannon_entropy_queue(current->q, values);
+
+    /* Per-element distribution in deciles of the maximum entropy */
+    int decile[10] = {0};
+    double min = 100, max = 0, mean = 0;
+    for (int i = 0; i < cnt; i++) {
+        double v = values[i];
+        if (v < min)
+            min = v;
+        if (v > max)
+            max = v;
+        mean += v;
+        decile[v >= 100 ? 9 : (int) (v / 10)]++;
+    }
+    if (cnt)
+        mean /= cnt;
+    else
+        min = 0;
+    free(values);
+
+    report(1, "Entropy of queue = %3.2f%% over %d elements", total, cnt);
+    report(1, "Per element: min = %3.2f%%, mean = %3.2f%%, max = %3.2f%%", min,
+           mean, max);
+    for (int i = 0; i < 10; i++) {
+        if (decile[i])
+            report(1, "  %3d%% - %3d%%: %d", i * 10, (i + 1) * 10, decile[i]);
+    }
+    return true;
+}
+
+static bool do_mem(int argc, char *argv[])
+{
+    if (argc == 2 && !strcmp(argv[1], "reset")) {
+        reset_memory_mark();
+        return true;
+    }
+
+    if (argc != 1) {
+        report(1, "%s takes no arguments or 'reset'", argv[0]);
+        return false;
+    }
+
+    mem_stat_t stat;
+    get_memory_stat(&stat);
+    report(1, "Current = %zu bytes in %zu blocks (+%zu bytes overhead)",
+           stat.current_bytes, allocation_check(), stat.overhead_bytes);
+    report(1, "Peak = %zu bytes, high-water mark = %zu bytes",
+           stat.peak_bytes, stat.mark_bytes);
+    report(1, "Allocations = %zu, frees = %zu", stat.alloc_cnt,
+           stat.free_cnt);
+
+    report(1, "Size histogram (live/total):");
+    for (int k = 0; k < MEM_HIST_SIZE; k++) {
+        if (!stat.hist_total[k])
+            continue;
+        size_t lo = k ? (size_t) 1 << (k - 1) : 0;
+        if (k == MEM_HIST_SIZE - 1)
+            report(1, "  >= %-10zu %12zu/%-12zu", lo, stat.hist_live[k],
+                   stat.hist_total[k]);
+        else
+            report(1, "  %10zu-%-10zu %12zu/%-12zu", lo,
+                   ((size_t) 1 << k) - 1, stat.hist_live[k],
+                   stat.hist_total[k]);
+    }
+
+    return true;
+}
+
 static bool do_prev(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -1151,6 +1698,7 @@ static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
     ADD_COMMAND(free, "Delete queue", "");
+    ADD_COMMAND(close, "End the web session, deleting its queues", "");
     ADD_COMMAND(prev, "Switch to previous queue", "");
     ADD_COMMAND(next, "Switch to next queue", "");
     ADD_COMMAND(ih,
@@ -1175,6 +1723,34 @@ static void console_init()
                 "Sort queue int accending/descending order with list sort", "");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
     ADD_COMMAND(show, "Show queue contents", "");
+    ADD_COMMAND(simulate,
+                "Test whether operation runs in constant time (size, swap, "
+                "etc. are expected not to)",
+                "op");
+    ADD_COMMAND(complexity,
+                "Estimate the complexity of operation from its running time "
+                "over growing queues",
+                "op [K]");
+    ADD_COMMAND(sortbench,
+                "Time sorts of every backend on inputs of 1000 elements up to "
+                "max_size, counting comparisons and allocations",
+                "[max_size] [input ...]");
+    ADD_COMMAND(compile,
+                "Compile trace into a stream of operations for replay, with "
+                "sourced files inlined",
+                "trace out");
+    ADD_COMMAND(replay,
+                "Run compiled trace, queue operations straight against the "
+                "queue API unless 'check' runs every command with its checks",
+                "file [check]");
+    ADD_COMMAND(entropy,
+                "Show Shannon entropy of the whole queue and distribution "
+                "over its elements",
+                "");
+    ADD_COMMAND(mem,
+                "Show memory usage of queue allocations. 'reset' restarts "
+                "the high-water mark",
+                "[reset]");
     ADD_COMMAND(dm, "Delete middle node in queue", "");
     ADD_COMMAND(dedup, "Delete all nodes that have duplicate string", "");
     ADD_COMMAND(merge, "Merge all the queues into one sorted queue", "");
@@ -1189,24 +1765,82 @@ static void console_init()
                 "");
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
+
+    /* Queue elements of each command counted in the metrics */
+    char *changing[] = {"ih", "it", "rh", "rt"};
+    for (size_t i = 0; i < sizeof(changing) / sizeof(changing[0]); i++)
+        set_cmd_elements(changing[i], ELEMENTS_CHANGED);
+    char *visiting[] = {"free",    "reverse", "sort",    "listSort",
+                        "size",    "show",    "entropy", "dm",
+                        "dedup",   "merge",   "swap",    "ascend",
+                        "descend", "reverseK"};
+    for (size_t i = 0; i < sizeof(visiting) / sizeof(visiting[0]); i++)
+        set_cmd_elements(visiting[i], ELEMENTS_VISITED);
+    /* Measurements which take the whole machine */
+    char *console_only[] = {"simulate", "complexity", "sortbench"};
+    for (size_t i = 0; i < sizeof(console_only) / sizeof(console_only[0]); i++)
+        set_cmd_console_only(console_only[i]);
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("guard", &guard_mode,
+              "Place each allocation against an inaccessible guard page",
+              NULL);
+    add_param("session_idle", &session_idle,
+              "Seconds a web session may stay idle before it is ended",
+              NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("seed", &seed,
+              "Seed for RAND strings and malloc failures (reproducible runs)",
+              seed_changed);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("workers", &dudect_workers,
+              "Number of threads measuring in simulation mode", NULL);
+    add_param("timer", &cpucycles_backend,
+              "Counter of simulation mode: 0 TSC, 1 perf cycles, 2 perf "
+              "instructions, 3 clock_gettime",
+              timer_changed);
 }
 
 /* Signal handlers */
-static void sigsegv_handler(int sig)
+
+/* Print string with write(), since stdio is not async-signal-safe */
+static void write_str(const char *s)
 {
+    ssize_t ret = write(STDOUT_FILENO, s, strlen(s));
+    (void) ret;
+}
+
+static void sigsegv_handler(int sig, siginfo_t *info, void *ucontext)
+{
+    /* abort() skips the exit handlers, which would write out the log */
+    logger_panic();
     /* Avoid possible non-reentrant signal function be used in signal handler */
     assert(write(1,
                  "Segmentation fault occurred.  You dereferenced a NULL or "
                  "invalid pointer",
                  73) == 73);
+
+    const char *reason = guard_fault_reason(info->si_addr);
+    if (reason) {
+        write_str("\nGuard page mode: ");
+        write_str(reason);
+    }
+
+    char **cmd_argv;
+    int cmd_argc = get_running_cmd(&cmd_argv);
+    if (cmd_argc > 0) {
+        write_str("\nOffending command:");
+        for (int i = 0; i < cmd_argc; i++) {
+            write_str(" ");
+            write_str(cmd_argv[i]);
+        }
+    }
+    write_str("\n");
+
     /* Raising a SIGABRT signal to produce a core dump for debugging. */
     abort();
 }
@@ -1222,29 +1856,212 @@ static void q_init()
 {
     fail_count = 0;
     INIT_LIST_HEAD(&chain.head);
-    signal(SIGSEGV, sigsegv_handler);
+    INIT_LIST_HEAD(&sessions[0].chain.head);
+    sessions[0].owner = pthread_self();
+    active_session = &sessions[0];
+
+    /* Faulting address tells apart guard page hits */
+    struct sigaction sa = {
+        .sa_sigaction = sigsegv_handler,
+        .sa_flags = SA_SIGINFO,
+    };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
     signal(SIGALRM, sigalrm_handler);
 }
 
-static bool q_quit(int argc, char *argv[])
+/* Size of the current queue, for the per element counts of perf */
+static int q_current_size(void)
 {
-    report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
+    return current ? current->size : 0;
+}
 
+/* Free every queue of the chain at head, return how many there were */
+static int free_queues(struct list_head *head)
+{
+    int n = 0;
     if (exception_setup(true)) {
-        struct list_head *cur = chain.head.next;
-        while (chain.size > 0) {
+        struct list_head *cur = head->next;
+        while (cur != head) {
             queue_contex_t *qctx = list_entry(cur, queue_contex_t, chain);
             cur = cur->next;
+            if (qctx->size > BIG_LIST_SIZE)
+                set_cautious_mode(false);
             q_free(qctx->q);
+            set_cautious_mode(true);
             free(qctx);
-            chain.size--;
+            n++;
         }
     }
-
     exception_cancel();
     set_cautious_mode(true);
+    INIT_LIST_HEAD(head);
+    return n;
+}
+
+/* End the parked sessions of the calling thread idle for longer than
+ * session_idle seconds
+ */
+static void expire_sessions(uint64_t now)
+{
+    for (int i = 1; i < n_sessions; i++) {
+        session_t *s = &sessions[i];
+        if (!s->used || s->active || !pthread_equal(s->owner, pthread_self()) ||
+            now - s->last_used <= (uint64_t) session_idle * 1000000000)
+            continue;
+        report(3, "Session '%s' expired with %d queues", s->id, s->chain.size);
+        free_queues(&s->chain.head);
+        parked_queues -= s->chain.size;
+        s->chain.size = 0;
+        s->current = NULL;
+        s->used = false;
+    }
+}
+
+/* Find session id, or start it for the calling thread */
+static session_t *find_session(const char *id, uint64_t now)
+{
+    session_t *s = NULL;
+    for (int i = 0; i < n_sessions && !s; i++) {
+        if (sessions[i].used && !strcmp(sessions[i].id, id))
+            s = &sessions[i];
+    }
+    if (s && !pthread_equal(s->owner, pthread_self())) {
+        report(1, "ERROR: Session '%s' is served by another thread", id);
+        return NULL;
+    }
+    if (s)
+        return s;
+
+    expire_sessions(now);
+    for (int i = 1; i < n_sessions && !s; i++) {
+        if (!sessions[i].used && !sessions[i].active)
+            s = &sessions[i];
+    }
+    if (!s && n_sessions < MAX_SESSIONS)
+        s = &sessions[n_sessions++];
+    if (!s) {
+        report(1, "ERROR: No room for session '%s', %d are open", id,
+               MAX_SESSIONS);
+        return NULL;
+    }
+    snprintf(s->id, sizeof(s->id), "%s", id);
+    s->used = true;
+    s->owner = pthread_self();
+    INIT_LIST_HEAD(&s->chain.head);
+    s->chain.size = 0;
+    s->current = NULL;
+    return s;
+}
+
+/* Make the queues of session id those commands work on. With id NULL, go
+ * back to those of the thread: of session "" on the console, and none on a
+ * web worker.
+ */
+static bool q_enter_session(const char *id)
+{
+    uint64_t now;
+    init_time(&now);
+    /* Made on the first entry to a session of a web worker */
+    if (!chain.head.next)
+        INIT_LIST_HEAD(&chain.head);
+
+    pthread_mutex_lock(&session_lock);
+    session_t *s = NULL;
+    if (id)
+        s = find_session(id, now);
+    else if (!web_worker())
+        s = &sessions[0];
+    if (id && !s) {
+        pthread_mutex_unlock(&session_lock);
+        return false;
+    }
+    if (s)
+        s->last_used = now;
+    if (s == active_session) {
+        pthread_mutex_unlock(&session_lock);
+        return true;
+    }
+
+    /* Park the queues of the active session, then take those of s. Queues
+     * made after a session was closed go with it.
+     */
+    session_t *a = active_session;
+    if (a && !a->used) {
+        free_queues(&chain.head);
+        chain.size = 0;
+        current = NULL;
+    }
+    if (a) {
+        list_splice_init(&chain.head, &a->chain.head);
+        a->chain.size = chain.size;
+        a->current = current;
+        parked_queues += chain.size;
+        a->active = false;
+    }
+    chain.size = 0;
+    current = NULL;
+
+    if (s) {
+        list_splice_init(&s->chain.head, &chain.head);
+        chain.size = s->chain.size;
+        current = s->current;
+        parked_queues -= chain.size;
+        s->chain.size = 0;
+        s->current = NULL;
+        s->active = true;
+    }
+    active_session = s;
+    pthread_mutex_unlock(&session_lock);
+    return true;
+}
+
+/* End the sessions of a web worker which stops, as no other thread may free
+ * their queues
+ */
+static bool q_worker_stop(void)
+{
+    q_enter_session(NULL);
+    pthread_mutex_lock(&session_lock);
+    for (int i = 1; i < n_sessions; i++) {
+        session_t *s = &sessions[i];
+        if (!s->used || !pthread_equal(s->owner, pthread_self()))
+            continue;
+        free_queues(&s->chain.head);
+        s->chain.size = 0;
+        s->current = NULL;
+        s->used = false;
+    }
+    pthread_mutex_unlock(&session_lock);
+    parked_queues = 0;
+    replay_buf_free();
+    exception_release();
+
+    size_t bcnt = allocation_check();
+    if (bcnt > 0) {
+        report(1,
+               "ERROR: Freed the queues of a web worker, but %lu blocks are "
+               "still allocated",
+               bcnt);
+        return false;
+    }
+    return true;
+}
+
+static bool q_quit(int argc, char *argv[])
+{
+    report(3, "Freeing queue");
+
+    replay_buf_free();
+    for (int i = 0; i < n_sessions; i++) {
+        if (!sessions[i].used ||
+            !pthread_equal(sessions[i].owner, pthread_self()))
+            continue;
+        q_enter_session(sessions[i].id);
+        free_queues(&chain.head);
+        chain.size = 0;
+        current = NULL;
+    }
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -1258,11 +2075,12 @@ static bool q_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE][-t TFILE]\n", cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-t TFILE   Write the time of each command to TFILE\n");
     exit(0);
 }
 
@@ -1475,7 +2293,7 @@ int main(int argc, char *argv[])
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:l:t:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1500,6 +2318,12 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 't':
+            if (!set_timing_log(optarg)) {
+                fprintf(stderr, "Couldn't open timing file %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1508,9 +2332,10 @@ int main(int argc, char *argv[])
     }
 
     /* A better seed can be obtained by combining getpid() and its parent ID
-     * with the Unix time.
+     * with the Unix time.  Show it with 'option' to reproduce the run.
      */
-    srand(os_random(getpid() ^ getppid()));
+    seed = (int) (os_random(getpid() ^ getppid()) & INT_MAX);
+    prng_seed(seed);
 
     q_init();
     init_cmd();
@@ -1529,9 +2354,12 @@ int main(int argc, char *argv[])
     if (level > 1)
         set_echo(true);
     if (logfile_name)
-        set_logfile(logfile_name);
+        set_logfile(logfile_name, false);
 
     add_quit_helper(q_quit);
+    set_size_helper(q_current_size);
+    set_session_helper(q_enter_session);
+    set_worker_helper(q_worker_stop);
 
     bool ok = true;
     ok = ok && run_console(infile_name);
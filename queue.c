@@ -336,8 +336,11 @@ int q_merge(struct list_head *head, bool descend)
     return node->size;
 }
 
+__thread uint64_t cmp_count = 0;
+
 int cmp(struct list_head *a, struct list_head *b, bool descend)
 {
+    cmp_count++;
     element_t *A = list_entry(a, element_t, list);
     element_t *B = list_entry(b, element_t, list);
     int ret = strcmp(A->value, B->value);
@@ -9,6 +9,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "harness.h"
 #include "list.h"
@@ -253,4 +254,7 @@ int q_descend(struct list_head *head);
 int q_merge(struct list_head *head, bool descend);
 void q_listSort(struct list_head *head, bool descend);
 int cmp(struct list_head *a, struct list_head *b, bool descend);
+
+/* Number of calls of cmp() by the thread, for the sort benchmark */
+extern __thread uint64_t cmp_count;
 #endif /* LAB0_QUEUE_H */
@@ -30,6 +30,9 @@
 
 #include "random.h"
 
+#include <pthread.h>
+#include <string.h>
+
 #if defined(__linux__) || defined(__GNU__)
 /* We would need to include <linux/random.h>, but not every target has access
  * to the linux headers. We only need RNDGETENTCNT, so we instead inline it.
@@ -272,7 +275,7 @@ static int bsd_randombytes(void *buf, size_t n)
 }
 #endif
 
-int randombytes(uint8_t *buf, size_t n)
+static int randombytes_os(uint8_t *buf, size_t n)
 {
 #if defined(__linux__) || defined(__GNU__)
 #if defined(USE_GLIBC)
@@ -291,3 +294,114 @@ int randombytes(uint8_t *buf, size_t n)
 #error "randombytes(...) is not supported on this platform"
 #endif
 }
+
+/* Small requests are served from a per-thread pool of OS entropy, refilled
+ * RANDOM_POOL_SIZE bytes at a time, instead of a syscall per call.
+ */
+#define RANDOM_POOL_SIZE 4096
+
+static __thread struct {
+    uint8_t buf[RANDOM_POOL_SIZE];
+    size_t pos; /* Bytes already served */
+    uint64_t bits;
+    int nbits; /* Bits left in bits */
+} pool = {.pos = RANDOM_POOL_SIZE};
+
+/* A forked child must not hand out the same bytes as its parent */
+static void pool_discard(void)
+{
+    pool.pos = RANDOM_POOL_SIZE;
+    pool.nbits = 0;
+}
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void pool_init(void)
+{
+    pthread_atfork(NULL, NULL, pool_discard);
+}
+
+int randombytes(uint8_t *buf, size_t n)
+{
+    if (n >= RANDOM_POOL_SIZE)
+        return randombytes_os(buf, n);
+
+    while (n > 0) {
+        if (pool.pos == RANDOM_POOL_SIZE) {
+            pthread_once(&pool_once, pool_init);
+            int ret = randombytes_os(pool.buf, RANDOM_POOL_SIZE);
+            if (ret)
+                return ret;
+            pool.pos = 0;
+        }
+
+        size_t chunk = RANDOM_POOL_SIZE - pool.pos;
+        if (chunk > n)
+            chunk = n;
+        memcpy(buf, pool.buf + pool.pos, chunk);
+        pool.pos += chunk;
+        buf += chunk;
+        n -= chunk;
+    }
+    return 0;
+}
+
+uint8_t randombit(void)
+{
+    if (!pool.nbits) {
+        randombytes((uint8_t *) &pool.bits, sizeof(pool.bits));
+        pool.nbits = 64;
+    }
+
+    uint8_t ret = pool.bits & 1;
+    pool.bits >>= 1;
+    pool.nbits--;
+    return ret;
+}
+
+/* State of xoshiro256**, initialized as if by prng_seed(0). Each thread has
+ * its own state, so only the thread calling prng_seed() is reseeded.
+ */
+static __thread uint64_t prng_state[4] = {
+    0xe220a8397b1dcdafULL,
+    0x6e789e6aa1b965f4ULL,
+    0x06c45d188009454fULL,
+    0xf88bb8a8724c81ecULL,
+};
+
+void prng_seed(uint64_t seed)
+{
+    for (int i = 0; i < 4; i++) {
+        seed += 0x9e3779b97f4a7c15ULL;
+#if M_INTPTR_SIZE == 8
+        prng_state[i] = random_shuffle(seed);
+#else
+        prng_state[i] = (uint64_t) random_shuffle(seed >> 32) << 32 |
+                        random_shuffle((uintptr_t) seed);
+#endif
+    }
+}
+
+static inline uint64_t rotl(const uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/* by David Blackman and Sebastiano Vigna, see:
+ * <https://prng.di.unimi.it/xoshiro256starstar.c>
+ */
+uint64_t prng_next(void)
+{
+    uint64_t *s = prng_state;
+    const uint64_t result = rotl(s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return result;
+}
@@ -4,14 +4,13 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/* Cryptographically secure random bytes from the OS, buffered in userspace.
+ * Return 0 on success.
+ */
 extern int randombytes(uint8_t *buf, size_t len);
 
-static inline uint8_t randombit(void)
-{
-    uint8_t ret = 0;
-    randombytes(&ret, 1);
-    return ret & 1;
-}
+/* One random bit, taken from a buffered word of randombytes() output */
+extern uint8_t randombit(void);
 
 #if INTPTR_MAX == INT64_MAX
 #define M_INTPTR_SHIFT (3)
@@ -48,4 +47,18 @@ static inline uintptr_t random_shuffle(uintptr_t x)
     return x;
 }
 
+/* Seedable pseudo-random number generator (xoshiro256**) for hot paths,
+ * where reproducible runs and speed matter more than cryptographic quality.
+ * It never makes syscalls.  The seed is expanded with splitmix64, whose
+ * output function is random_shuffle().  The state is per thread.
+ */
+void prng_seed(uint64_t seed);
+uint64_t prng_next(void);
+
+/* Uniform random integer in [0, n) */
+static inline uint32_t prng_below(uint32_t n)
+{
+    return (uint32_t) (((prng_next() >> 32) * n) >> 32);
+}
+
 #endif
@@ -1,3 +1,5 @@
+#include <math.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -5,10 +7,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
-#include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "logger.h"
 #include "report.h"
 #include "web.h"
 
@@ -17,6 +19,33 @@
 static FILE *errfile = NULL;
 static FILE *verbfile = NULL;
 static FILE *logfile = NULL;
+static bool log_binary = false;
+
+/* Bytes of output the logger may hold when it runs */
+#define LOGGER_RING (1 << 20)
+
+/* Write a message to f, through the logger when it runs */
+static void put_message(FILE *f, bool newline, const char *fmt, va_list ap)
+{
+    if (f == logfile && log_binary) {
+        logger_vrecord(fileno(f), newline, fmt, ap);
+    } else if (logger_active()) {
+        logger_vprintf(fileno(f), newline, fmt, ap);
+    } else {
+        vfprintf(f, fmt, ap);
+        if (newline)
+            fputc('\n', f);
+        fflush(f);
+    }
+}
+
+static void put_line(FILE *f, bool newline, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    put_message(f, newline, fmt, ap);
+    va_end(ap);
+}
 
 int verblevel = 0;
 static void init_files(FILE *efile, FILE *vfile)
@@ -34,7 +63,7 @@ static void default_fatal_fun()
 {
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
     if (logfile)
-        fputs(fail_buf, logfile);
+        put_line(logfile, false, "%s", fail_buf);
 }
 
 /* Optional function to call when fatal error encountered */
@@ -45,12 +74,41 @@ void set_verblevel(int level)
     verblevel = level;
 }
 
-bool set_logfile(const char *file_name)
+bool set_logfile(const char *file_name, bool binary)
 {
+    logger_flush();
     logfile = fopen(file_name, "w");
+    log_binary = binary && logfile;
+    if (log_binary)
+        logger_binary_start(fileno(logfile));
     return logfile != NULL;
 }
 
+static void close_logfile(void)
+{
+    logger_flush();
+    fclose(logfile);
+    logfile = NULL;
+}
+
+bool set_async_log(int mode)
+{
+    static bool exit_registered = false;
+    if (!mode) {
+        logger_stop();
+        return true;
+    }
+    fflush(stdout);
+    if (logfile)
+        fflush(logfile);
+    if (!logger_start(LOGGER_RING, mode == 2 ? LOGGER_DROP : LOGGER_BLOCK))
+        return false;
+    /* Whatever way the program ends, the output is written */
+    if (!exit_registered)
+        exit_registered = !atexit(logger_stop);
+    return true;
+}
+
 void report_event(message_t msg, char *fmt, ...)
 {
     va_list ap;
@@ -71,21 +129,33 @@ void report_event(message_t msg, char *fmt, ...)
     if (!errfile)
         init_files(stdout, stdout);
 
+    /* What is buffered comes first, and the last words are not left to a
+     * thread which exit() may not wait for
+     */
+    if (fatal)
+        logger_stop();
+
     va_start(ap, fmt);
-    fprintf(errfile, "%s: ", msg_name);
-    vfprintf(errfile, fmt, ap);
-    fprintf(errfile, "\n");
-    fflush(errfile);
+    put_line(errfile, false, "%s: ", msg_name);
+    put_message(errfile, true, fmt, ap);
     va_end(ap);
 
+    if (web_capturing()) {
+        va_start(ap, fmt);
+        web_printf("%s: ", msg_name);
+        web_vprintf(fmt, ap);
+        web_printf("\n");
+        va_end(ap);
+    }
+
     if (logfile) {
         va_start(ap, fmt);
-        fprintf(logfile, "Error: ");
-        vfprintf(logfile, fmt, ap);
-        fprintf(logfile, "\n");
-        fflush(logfile);
+        put_line(logfile, false, "Error: ");
+        put_message(logfile, true, fmt, ap);
         va_end(ap);
-        fclose(logfile);
+        /* Other threads may be writing to it */
+        if (!web_worker())
+            close_logfile();
     }
 
     if (fatal) {
@@ -95,38 +165,30 @@ void report_event(message_t msg, char *fmt, ...)
     }
 }
 
-#define BUF_SIZE 4096
-extern int web_connfd;
 void report(int level, char *fmt, ...)
 {
     if (!verbfile)
         init_files(stdout, stdout);
 
-    char buffer[BUF_SIZE];
     if (level <= verblevel) {
         va_list ap;
         va_start(ap, fmt);
-        vfprintf(verbfile, fmt, ap);
-        fprintf(verbfile, "\n");
-        fflush(verbfile);
+        put_message(verbfile, true, fmt, ap);
         va_end(ap);
 
         if (logfile) {
             va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fprintf(logfile, "\n");
-            fflush(logfile);
+            put_message(logfile, true, fmt, ap);
             va_end(ap);
         }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
-    }
-    if (web_connfd) {
-        int len = strlen(buffer);
-        buffer[len] = '\n';
-        buffer[len + 1] = '\0';
-        web_send(web_connfd, buffer);
+
+        /* Formatted straight into the response of the client */
+        if (web_capturing()) {
+            va_start(ap, fmt);
+            web_vprintf(fmt, ap);
+            va_end(ap);
+            web_printf("\n");
+        }
     }
 }
 
@@ -135,27 +197,24 @@ void report_noreturn(int level, char *fmt, ...)
     if (!verbfile)
         init_files(stdout, stdout);
 
-    char buffer[BUF_SIZE];
     if (level <= verblevel) {
         va_list ap;
         va_start(ap, fmt);
-        vfprintf(verbfile, fmt, ap);
-        fflush(verbfile);
+        put_message(verbfile, false, fmt, ap);
         va_end(ap);
 
         if (logfile) {
             va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fflush(logfile);
+            put_message(logfile, false, fmt, ap);
             va_end(ap);
         }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
-    }
 
-    if (web_connfd)
-        web_send(web_connfd, buffer);
+        if (web_capturing()) {
+            va_start(ap, fmt);
+            web_vprintf(fmt, ap);
+            va_end(ap);
+        }
+    }
 }
 
 /* Functions denoting failures */
@@ -163,22 +222,21 @@ void report_noreturn(int level, char *fmt, ...)
 /* Need to be able to print without using malloc */
 static void fail_fun(const char *format, const char *msg)
 {
+    logger_stop();
     snprintf(fail_buf, sizeof(fail_buf), format, msg);
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
     /* Use write to avoid any buffering issues */
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
 
-    if (logfile) {
-        /* Don't know file descriptor for logfile */
-        fputs(fail_buf, logfile);
-    }
+    if (logfile)
+        put_line(logfile, false, "%s", fail_buf);
 
     if (fatal_fun)
         fatal_fun();
 
     if (logfile)
-        fclose(logfile);
+        close_logfile();
 
     exit(1);
 }
@@ -197,10 +255,35 @@ static size_t peak_bytes = 0;
 static size_t last_peak_bytes = 0;
 static size_t current_bytes = 0;
 
+/* Web workers allocate through here too */
+static pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void count_alloc(size_t bytes)
+{
+    pthread_mutex_lock(&count_lock);
+    allocate_cnt++;
+    allocate_bytes += bytes;
+    current_bytes += bytes;
+    peak_bytes = MAX(peak_bytes, current_bytes);
+    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
+    pthread_mutex_unlock(&count_lock);
+}
+
+static void count_free(size_t bytes)
+{
+    pthread_mutex_lock(&count_lock);
+    free_cnt++;
+    free_bytes += bytes;
+    current_bytes -= bytes;
+    pthread_mutex_unlock(&count_lock);
+}
+
 static void check_exceed(size_t new_bytes)
 {
     size_t limit_bytes = (size_t) mblimit << 20;
+    pthread_mutex_lock(&count_lock);
     size_t request_bytes = new_bytes + current_bytes;
+    pthread_mutex_unlock(&count_lock);
     if (mblimit > 0 && request_bytes > limit_bytes) {
         report_event(MSG_FATAL,
                      "Exceeded memory limit of %u megabytes with %lu bytes",
@@ -218,11 +301,7 @@ void *malloc_or_fail(size_t bytes, const char *fun_name)
         return NULL;
     }
 
-    allocate_cnt++;
-    allocate_bytes += bytes;
-    current_bytes += bytes;
-    peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
+    count_alloc(bytes);
 
     return p;
 }
@@ -237,11 +316,7 @@ void *calloc_or_fail(size_t cnt, size_t bytes, const char *fun_name)
         return NULL;
     }
 
-    allocate_cnt++;
-    allocate_bytes += cnt * bytes;
-    current_bytes += cnt * bytes;
-    peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
+    count_alloc(cnt * bytes);
 
     return p;
 }
@@ -257,11 +332,7 @@ char *strsave_or_fail(const char *s, const char *fun_name)
     if (!ss)
         fail_fun("strsave failed in %s", fun_name);
 
-    allocate_cnt++;
-    allocate_bytes += len + 1;
-    current_bytes += len + 1;
-    peak_bytes = MAX(peak_bytes, current_bytes);
-    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
+    count_alloc(len + 1);
 
     return strncpy(ss, s, len + 1);
 }
@@ -273,9 +344,7 @@ void free_block(void *b, size_t bytes)
         report_event(MSG_ERROR, "Attempting to free null block");
     free(b);
 
-    free_cnt++;
-    free_bytes += bytes;
-    current_bytes -= bytes;
+    count_free(bytes);
 }
 
 /* Free array, as from calloc */
@@ -285,9 +354,7 @@ void free_array(void *b, size_t cnt, size_t bytes)
         report_event(MSG_ERROR, "Attempting to free null block");
     free(b);
 
-    free_cnt++;
-    free_bytes += cnt * bytes;
-    current_bytes -= cnt * bytes;
+    count_free(cnt * bytes);
 }
 
 /* Free string saved by strsave_or_fail */
@@ -299,17 +366,59 @@ void free_string(char *s)
 }
 
 /* Initialization of timers */
-void init_time(double *timep)
+void init_time(uint64_t *timep)
 {
     (void) delta_time(timep);
 }
 
-double delta_time(double *timep)
+uint64_t delta_time(uint64_t *timep)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    double current_time = tv.tv_sec + 1.0E-6 * tv.tv_usec;
-    double delta = current_time - *timep;
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    uint64_t current_time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    uint64_t delta = current_time - *timep;
     *timep = current_time;
     return delta;
 }
+
+void time_stat_init(time_stat_t *s)
+{
+    s->n = 0;
+    s->min = UINT64_MAX;
+    s->max = 0;
+    s->mean = 0.0;
+    s->m2 = 0.0;
+}
+
+/* Welford's online update, which does not lose precision to cancellation */
+void time_stat_add(time_stat_t *s, uint64_t ns)
+{
+    s->n++;
+    s->min = ns < s->min ? ns : s->min;
+    s->max = ns > s->max ? ns : s->max;
+    double delta = ns - s->mean;
+    s->mean += delta / s->n;
+    s->m2 += delta * (ns - s->mean);
+}
+
+double time_stat_stddev(const time_stat_t *s)
+{
+    return s->n > 1 ? sqrt(s->m2 / (s->n - 1)) : 0.0;
+}
+
+char *format_time(char *buf, size_t len, double ns)
+{
+    if (ns < 1e3)
+        snprintf(buf, len, "%.0f ns", ns);
+    else if (ns < 1e6)
+        snprintf(buf, len, "%.3f us", ns / 1e3);
+    else if (ns < 1e9)
+        snprintf(buf, len, "%.3f ms", ns / 1e6);
+    else
+        snprintf(buf, len, "%.3f s", ns / 1e9);
+    return buf;
+}
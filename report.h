@@ -3,6 +3,8 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /* Ways to report interesting behavior and errors */
 
@@ -12,7 +14,15 @@ typedef enum { MSG_WARN, MSG_ERROR, MSG_FATAL, N_MSG } message_t;
 /* Buffer sizes */
 #define MAX_CHAR 512
 
-bool set_logfile(const char *file_name);
+/* Copy the output to file_name, in binary records if binary, which
+ * scripts/logfmt.py formats
+ */
+bool set_logfile(const char *file_name, bool binary);
+
+/* Write output from a background thread if mode is 1, or also drop what it
+ * cannot keep up with if mode is 2. Mode 0 writes it synchronously.
+ */
+bool set_async_log(int mode);
 
 extern int verblevel;
 void set_verblevel(int level);
@@ -44,10 +54,27 @@ void free_array(void *b, size_t cnt, size_t bytes);
 /* Free string saved by strsave_or_fail */
 void free_string(char *s);
 
-/* Time counted as fp number in seconds */
-void init_time(double *timep);
+/* Time counted in nanoseconds of a monotonic clock, which neither NTP
+ * slewing nor changes of the time of day affect
+ */
+void init_time(uint64_t *timep);
 
 /* Compute time since last call with this timer and reset timer */
-double delta_time(double *timep);
+uint64_t delta_time(uint64_t *timep);
+
+/* Distribution of the times of repeated runs */
+typedef struct {
+    uint64_t n;
+    uint64_t min, max;
+    double mean;
+    double m2; /* Sum of squared deviations from the mean */
+} time_stat_t;
+
+void time_stat_init(time_stat_t *s);
+void time_stat_add(time_stat_t *s, uint64_t ns);
+double time_stat_stddev(const time_stat_t *s);
+
+/* Print ns into buf in the unit that gives it 1 to 3 integer digits */
+char *format_time(char *buf, size_t len, double ns);
 
 #endif /* LAB0_REPORT_H */
@@ -0,0 +1,260 @@
+#!/usr/bin/env python3
+"""Benchmark qtest commands over trace files.
+
+  bench.py run [-n RUNS] [-w WARMUP] [-D NAME=VALUE] [-o FILE] [TRACE ...]
+  bench.py compare BASELINE CURRENT [-t PERCENT]
+  bench.py read [-s MB] [-n RUNS] [--pipe]
+
+'run' executes every trace RUNS times after WARMUP discarded runs, with the
+time of each command taken by qtest itself (option -t), and reports the
+median, 95th percentile, mean and variance of each command of each trace. The
+results go to FILE as JSON, or CSV when FILE ends with .csv.
+
+Traces may be parameterized: $NAME in a trace is replaced by the value given
+with -D, or else by the default from a '# bench: NAME=VALUE ...' line. Any
+other $NAME is left to qtest, as a variable of the trace itself.
+
+'compare' flags the commands of CURRENT whose median is slower than in
+BASELINE, both JSON results of 'run', by more than PERCENT, and exits with 1
+if there is any.
+
+'read' times qtest through a generated trace of MB megabytes of comments,
+which costs little more than reading and splitting its lines, from a file or
+with --pipe through a pipe.
+"""
+
+import argparse
+import csv
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+DEFAULT_TRACES = [
+    "traces/trace-14-perf.cmd",
+    "traces/trace-15-perf.cmd",
+    "traces/trace-16-perf.cmd",
+    "traces/bench-insert.cmd",
+    "traces/bench-sort.cmd",
+]
+
+# Commands which only set up the run
+SKIPPED = ("#", "option", "log", "source")
+
+FIELDS = ["trace", "index", "command", "n", "median", "p95", "mean",
+          "variance", "min", "max"]
+
+
+def expand(path, defines):
+    """Return the text of trace path with its parameters substituted"""
+    with open(path) as f:
+        text = f.read()
+    params = {}
+    for m in re.finditer(r"^#\s*bench:(.*)$", text, re.M):
+        for pair in m.group(1).split():
+            name, _, value = pair.partition("=")
+            params[name] = value
+    params.update(defines)
+
+    def subst(m):
+        return params.get(m.group(1), m.group(0))
+
+    return re.sub(r"\$(\w+)", subst, text), params
+
+
+def run_once(qtest, text):
+    """Run qtest on trace text, return [(command, seconds)] in order"""
+    with tempfile.TemporaryDirectory() as tmp:
+        trace = os.path.join(tmp, "trace.cmd")
+        timing = os.path.join(tmp, "timing.tsv")
+        with open(trace, "w") as f:
+            f.write(text)
+        proc = subprocess.run([qtest, "-v", "0", "-f", trace, "-t", timing],
+                              stdout=subprocess.PIPE,
+                              stderr=subprocess.STDOUT)
+        if proc.returncode:
+            sys.stdout.write(proc.stdout.decode(errors="replace"))
+            return None
+        times = []
+        with open(timing) as f:
+            for line in f:
+                seconds, _, command = line.rstrip("\n").partition("\t")
+                if command.split(" ", 1)[0] in SKIPPED:
+                    continue
+                times.append((command, float(seconds)))
+        return times
+
+
+def percentile(values, p):
+    """Nearest rank percentile of sorted values"""
+    rank = max(1, int(round(p / 100.0 * len(values))))
+    return values[rank - 1]
+
+
+def summarize(trace, index, command, samples):
+    samples = sorted(samples)
+    return {
+        "trace": trace,
+        "index": index,
+        "command": command,
+        "n": len(samples),
+        "median": statistics.median(samples),
+        "p95": percentile(samples, 95),
+        "mean": statistics.mean(samples),
+        "variance":
+        statistics.variance(samples) if len(samples) > 1 else 0.0,
+        "min": samples[0],
+        "max": samples[-1],
+    }
+
+
+def do_run(args):
+    defines = dict(d.partition("=")[::2] for d in args.define)
+    results = []
+    used = {}
+    for path in args.traces or DEFAULT_TRACES:
+        text, params = expand(path, defines)
+        used.update(params)
+        name = os.path.basename(path)
+        samples = None
+        for i in range(args.warmup + args.runs):
+            times = run_once(args.qtest, text)
+            if times is None:
+                sys.exit("%s failed" % name)
+            if i < args.warmup:
+                continue
+            if samples is None:
+                samples = [(c, []) for c, _ in times]
+            for (_, s), (_, t) in zip(samples, times):
+                s.append(t)
+        for index, (command, s) in enumerate(samples):
+            results.append(summarize(name, index, command, s))
+
+    report = {
+        "runs": args.runs,
+        "warmup": args.warmup,
+        "defines": used,
+        "results": results,
+    }
+    if not args.output:
+        for r in results:
+            print("%-18s %3d %-24s median %.6f  p95 %.6f  var %.3g" %
+                  (r["trace"], r["index"], r["command"][:24], r["median"],
+                   r["p95"], r["variance"]))
+    elif args.output.endswith(".csv"):
+        with open(args.output, "w", newline="") as f:
+            writer = csv.DictWriter(f, fieldnames=FIELDS)
+            writer.writeheader()
+            writer.writerows(results)
+    else:
+        with open(args.output, "w") as f:
+            json.dump(report, f, indent=2)
+
+
+def do_compare(args):
+    def load(path):
+        with open(path) as f:
+            return {(r["trace"], r["index"], r["command"]): r
+                    for r in json.load(f)["results"]}
+
+    base, cur = load(args.baseline), load(args.current)
+    regressions = 0
+    for key, r in cur.items():
+        b = base.get(key)
+        # Commands too fast to time are left out
+        if not b or b["median"] < args.min_time:
+            continue
+        change = (r["median"] - b["median"]) / b["median"] * 100
+        flag = ""
+        if change > args.threshold:
+            flag = "  REGRESSION"
+            regressions += 1
+        print("%-18s %3d %-24s %.6f -> %.6f  %+6.1f%%%s" %
+              (key[0], key[1], key[2][:24], b["median"], r["median"], change,
+               flag))
+    print("%d regression(s) beyond %.1f%%" % (regressions, args.threshold))
+    return 1 if regressions else 0
+
+
+def do_read(args):
+    with tempfile.TemporaryDirectory() as tmp:
+        trace = os.path.join(tmp, "read.cmd")
+        size = args.size << 20
+        lines = 0
+        with open(trace, "w") as f:
+            written = 0
+            while written < size:
+                # Lines of 10 to 160 bytes
+                line = "# %d %s\n" % (lines, "x" * (lines * 7 % 141))
+                f.write(line)
+                written += len(line)
+                lines += 1
+
+        samples = []
+        for i in range(args.warmup + args.runs):
+            start = time.perf_counter()
+            if args.pipe:
+                cat = subprocess.Popen(["cat", trace], stdout=subprocess.PIPE)
+                subprocess.run([args.qtest, "-v", "0", "-f", "/dev/stdin"],
+                               stdin=cat.stdout,
+                               check=True)
+                cat.stdout.close()
+                cat.wait()
+            else:
+                subprocess.run([args.qtest, "-v", "0", "-f", trace],
+                               check=True)
+            if i >= args.warmup:
+                samples.append(time.perf_counter() - start)
+
+    median = statistics.median(samples)
+    print("%d MB, %d lines: median %.3f s, min %.3f s, %.0f MB/s" %
+          (args.size, lines, median, min(samples), args.size / median))
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark qtest commands")
+    sub = parser.add_subparsers(dest="action")
+    sub.required = True
+
+    run = sub.add_parser("run", help="time the commands of traces")
+    run.add_argument("traces", nargs="*", help="trace files")
+    run.add_argument("-n", "--runs", type=int, default=10)
+    run.add_argument("-w", "--warmup", type=int, default=1)
+    run.add_argument("-D", "--define", action="append", default=[],
+                     metavar="NAME=VALUE", help="trace parameter")
+    run.add_argument("-o", "--output", help="JSON or .csv file")
+    run.add_argument("-p", "--qtest", default="./qtest")
+
+    compare = sub.add_parser("compare", help="flag regressions")
+    compare.add_argument("baseline")
+    compare.add_argument("current")
+    compare.add_argument("-t", "--threshold", type=float, default=10.0,
+                         help="allowed slowdown of the median in percent")
+    compare.add_argument("--min-time", type=float, default=1e-4,
+                         help="ignore commands faster than this in seconds")
+
+    read = sub.add_parser("read", help="time reading a big trace")
+    read.add_argument("-s", "--size", type=int, default=100,
+                      help="megabytes of trace")
+    read.add_argument("-n", "--runs", type=int, default=5)
+    read.add_argument("-w", "--warmup", type=int, default=1)
+    read.add_argument("--pipe", action="store_true",
+                      help="read the trace from a pipe, not a file")
+    read.add_argument("-p", "--qtest", default="./qtest")
+
+    args = parser.parse_args()
+    if args.action == "run":
+        do_run(args)
+        return 0
+    if args.action == "read":
+        return do_read(args)
+    return do_compare(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+"""Format a binary log of qtest, as written by 'log -b FILE', into text.
+
+  logfmt.py LOG [-o OUTPUT]
+
+A binary log keeps the arguments of each message instead of its text, so
+that qtest spends no time formatting it. It starts with a header:
+
+  char magic[4] = "QLOG", uint32 version = 1, uint32 order = 0x01020304
+
+then has records, in the byte order the order field tells:
+
+  'F' uint32 id, uint32 length, the text of a format
+  'M' uint32 id, uint8 newline, the arguments of the format of that id
+
+where each integer argument, including a '*' width or precision, takes 8
+bytes, each floating point one is a double, and each string is its length in
+4 bytes followed by its text.
+"""
+
+import argparse
+import re
+import struct
+import sys
+
+MAGIC = b"QLOG"
+VERSION = 1
+
+# flags, width, precision, length modifier, conversion
+SPEC = re.compile(r"%([-+ #0']*)(\*|\d*)(?:\.(\*|\d*))?([hlLqjzt]*)([a-zA-Z%])")
+
+
+class Reader:
+    def __init__(self, data, order):
+        self.data = data
+        self.pos = 0
+        self.order = order
+
+    def take(self, fmt):
+        fmt = self.order + fmt
+        size = struct.calcsize(fmt)
+        if self.pos + size > len(self.data):
+            raise EOFError
+        (value,) = struct.unpack_from(fmt, self.data, self.pos)
+        self.pos += size
+        return value
+
+    def text(self, n):
+        if self.pos + n > len(self.data):
+            raise EOFError
+        s = self.data[self.pos : self.pos + n]
+        self.pos += n
+        return s.decode("utf-8", errors="replace")
+
+    def done(self):
+        return self.pos >= len(self.data)
+
+
+def format_message(fmt, r):
+    """Text of the message of format fmt, with its arguments from r"""
+    out = []
+    last = 0
+    for m in SPEC.finditer(fmt):
+        out.append(fmt[last : m.start()])
+        last = m.end()
+        flags, width, precision, _, conv = m.groups()
+        if conv == "%":
+            out.append("%")
+            continue
+        if width == "*":
+            width = str(r.take("q"))
+        if precision == "*":
+            precision = str(r.take("q"))
+        spec = "%" + flags.replace("'", "") + width
+        if precision is not None:
+            spec += "." + precision
+        if conv in "di":
+            out.append((spec + "d") % r.take("q"))
+        elif conv in "uoxX":
+            out.append((spec + conv.replace("u", "d")) % r.take("Q"))
+        elif conv == "c":
+            out.append((spec + "c") % chr(r.take("q") & 0xFF))
+        elif conv in "eEfFgGaA":
+            value = r.take("d")
+            if conv in "aA":
+                out.append(value.hex())
+            else:
+                out.append((spec + conv) % value)
+        elif conv == "s":
+            out.append((spec + "s") % r.text(r.take("I")))
+        elif conv == "p":
+            out.append("0x%x" % r.take("Q"))
+        else:
+            # qtest stops encoding at a conversion it does not know
+            out.append(m.group(0))
+            break
+    out.append(fmt[last:])
+    return "".join(out)
+
+
+def convert(data, out):
+    if data[:4] != MAGIC:
+        sys.exit("not a binary log of qtest")
+    order = "<"
+    if struct.unpack_from("<I", data, 8)[0] != 0x01020304:
+        order = ">"
+    version = struct.unpack_from(order + "I", data, 4)[0]
+    if version != VERSION:
+        sys.exit("binary log of version %d, not %d" % (version, VERSION))
+
+    r = Reader(data, order)
+    r.pos = 12
+    formats = {}
+    try:
+        while not r.done():
+            kind = r.text(1)
+            if kind == "F":
+                fid = r.take("I")
+                formats[fid] = r.text(r.take("I"))
+            elif kind == "M":
+                fid = r.take("I")
+                newline = r.take("B")
+                if fid not in formats:
+                    sys.exit("message of unknown format %d" % fid)
+                out.write(format_message(formats[fid], r))
+                if newline:
+                    out.write("\n")
+            else:
+                sys.exit("corrupt record at byte %d" % (r.pos - 1))
+    except EOFError:
+        sys.exit("log cut short at byte %d" % r.pos)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter
+    )
+    parser.add_argument("log")
+    parser.add_argument("-o", "--output", help="write here instead of stdout")
+    args = parser.parse_args()
+
+    with open(args.log, "rb") as f:
+        data = f.read()
+    if args.output:
+        with open(args.output, "w") as out:
+            convert(data, out)
+    else:
+        convert(data, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,34 +1,115 @@
 #include <assert.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <string.h>
 
-/* Precalculated log2 realization */
-#include "log2_lshift16.h"
+#include "queue.h"
+
+/* Shannon entropy of byte strings, as percent of the 8 bits maximum.
+ *
+ * For n bytes of which c_i are equal to symbol i,
+ *   H = log2(n) - sum(c_i * log2(c_i)) / n = (n log2 n - sum(c_i log2 c_i)) / n
+ * so all that is needed is x * log2(x) of integers, which is looked up in a
+ * table for the counts found in ordinary strings.
+ */
 
-/* Shannon full integer entropy calculation */
 #define BUCKET_SIZE (1 << 8)
 
+/* Number of interleaved histograms. Consecutive bytes are counted in
+ * different histograms, so runs of the same byte do not stall on the
+ * increment of a counter whose store has not completed yet.
+ */
+#define N_HIST 4
+
+#define XLOG2X_SIZE 1024
+static double xlog2x_table[XLOG2X_SIZE];
+static pthread_once_t xlog2x_once = PTHREAD_ONCE_INIT;
+
+static void xlog2x_init(void)
+{
+    xlog2x_table[0] = 0;
+    for (int x = 1; x < XLOG2X_SIZE; x++)
+        xlog2x_table[x] = x * log2(x);
+}
+
+static inline double xlog2x(uint64_t x)
+{
+    return x < XLOG2X_SIZE ? xlog2x_table[x] : x * log2(x);
+}
+
+/* The histograms are cleared after each string by visiting its bytes again,
+ * rather than by a memset of every bucket.
+ */
+static __thread uint32_t bucket[N_HIST][BUCKET_SIZE];
+
+/* Return sum(c_i * log2(c_i)) of string s of length n, and add the counts to
+ * total if not NULL.
+ */
+static double count_string(const uint8_t *s, size_t n, uint64_t *total)
+{
+    size_t i = 0;
+    for (; i + N_HIST <= n; i += N_HIST) {
+        bucket[0][s[i]]++;
+        bucket[1][s[i + 1]]++;
+        bucket[2][s[i + 2]]++;
+        bucket[3][s[i + 3]]++;
+    }
+    for (; i < n; i++)
+        bucket[0][s[i]]++;
+
+    double sum = 0;
+    for (i = 0; i < n; i++) {
+        uint8_t b = s[i];
+        uint32_t c = bucket[0][b] + bucket[1][b] + bucket[2][b] + bucket[3][b];
+        if (!c)
+            continue;
+        /* First occurrence of this byte, so each symbol is counted once */
+        sum += xlog2x(c);
+        if (total)
+            total[b] += c;
+        bucket[0][b] = bucket[1][b] = bucket[2][b] = bucket[3][b] = 0;
+    }
+    return sum;
+}
+
+static inline double to_percent(double sum, uint64_t n)
+{
+    if (!n)
+        return 0;
+    return (xlog2x(n) - sum) / n * 100.0 / 8;
+}
+
 double shannon_entropy(const uint8_t *s)
 {
     assert(s);
-    const uint64_t count = strlen((char *) s);
-    uint64_t entropy_sum = 0;
-    const uint64_t entropy_max = 8 * LOG2_RET_SHIFT;
-
-    uint32_t bucket[256];
-    memset(&bucket, 0, sizeof(bucket));
-
-    for (uint32_t i = 0; i < count; i++)
-        bucket[s[i]]++;
-
-    for (uint32_t i = 0; i < BUCKET_SIZE; i++) {
-        if (bucket[i]) {
-            uint64_t p = bucket[i];
-            p *= LOG2_ARG_SHIFT / count;
-            entropy_sum += -p * log2_lshift16(p);
-        }
+    pthread_once(&xlog2x_once, xlog2x_init);
+
+    size_t n = strlen((const char *) s);
+    return to_percent(count_string(s, n, NULL), n);
+}
+
+/* Compute the entropy of every element of queue head in order into out,
+ * unless out is NULL, and return the entropy of all elements taken together.
+ */
+double shannon_entropy_queue(struct list_head *head, double *out)
+{
+    pthread_once(&xlog2x_once, xlog2x_init);
+
+    uint64_t total[BUCKET_SIZE] = {0};
+    uint64_t total_n = 0;
+    element_t *e;
+    list_for_each_entry (e, head, list) {
+        const uint8_t *s = (const uint8_t *) e->value;
+        size_t n = strlen(e->value);
+        double sum = count_string(s, n, total);
+        if (out)
+            *out++ = to_percent(sum, n);
+        total_n += n;
     }
 
-    entropy_sum /= LOG2_ARG_SHIFT;
-    return entropy_sum * 100.0 / entropy_max;
+    double sum = 0;
+    for (int i = 0; i < BUCKET_SIZE; i++)
+        sum += xlog2x(total[i]);
+    return to_percent(sum, total_n);
 }
@@ -0,0 +1,205 @@
+/* Sort benchmark over inputs which are known to trouble sorting algorithms:
+ * presorted runs defeat naive pivots and merges, duplicates and long common
+ * prefixes make every comparison costly, and so on. Each backend sorts its
+ * own copy of the same input.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+/* The allocation statistics are internal to the harness */
+#define INTERNAL 1
+#include "harness.h"
+
+#include "queue.h"
+#include "random.h"
+#include "report.h"
+#include "sort_bench.h"
+
+/* Length of the prefix shared by all strings of the prefix input */
+#define PREFIX_LEN 64
+
+/* Longest string of the random length input */
+#define MAX_RANDOM_LEN 48
+
+/* Write the i-th of the n strings of an input into buf */
+typedef void (*sort_input_fn)(char *buf, size_t len, int i, int n);
+
+static void random_word(char *buf, int len)
+{
+    for (int j = 0; j < len; j++)
+        buf[j] = 'a' + prng_below(26);
+    buf[len] = '\0';
+}
+
+static void gen_random(char *buf, size_t len, int i, int n)
+{
+    random_word(buf, 8);
+}
+
+static void gen_sorted(char *buf, size_t len, int i, int n)
+{
+    snprintf(buf, len, "%08d", i);
+}
+
+static void gen_reverse(char *buf, size_t len, int i, int n)
+{
+    snprintf(buf, len, "%08d", n - i);
+}
+
+/* Ascending up to the middle, then descending */
+static void gen_organ_pipe(char *buf, size_t len, int i, int n)
+{
+    snprintf(buf, len, "%08d", i < n / 2 ? i : n - i);
+}
+
+/* Ten distinct values */
+static void gen_few_unique(char *buf, size_t len, int i, int n)
+{
+    snprintf(buf, len, "%08u", prng_below(10));
+}
+
+/* Every value about ten times */
+static void gen_duplicates(char *buf, size_t len, int i, int n)
+{
+    snprintf(buf, len, "%08u", prng_below(n / 10 + 1));
+}
+
+static void gen_prefix(char *buf, size_t len, int i, int n)
+{
+    memset(buf, 'p', PREFIX_LEN);
+    random_word(buf + PREFIX_LEN, 8);
+}
+
+static void gen_random_length(char *buf, size_t len, int i, int n)
+{
+    random_word(buf, 1 + prng_below(MAX_RANDOM_LEN));
+}
+
+/* Sorted but for one element in a hundred */
+static void gen_nearly_sorted(char *buf, size_t len, int i, int n)
+{
+    snprintf(buf, len, "%08u", prng_below(100) ? i : prng_below(n));
+}
+
+static const struct {
+    const char *name;
+    sort_input_fn gen;
+} sort_inputs[] = {
+    {"random", gen_random},
+    {"sorted", gen_sorted},
+    {"reverse", gen_reverse},
+    {"organ-pipe", gen_organ_pipe},
+    {"few-unique", gen_few_unique},
+    {"duplicates", gen_duplicates},
+    {"prefix", gen_prefix},
+    {"random-length", gen_random_length},
+    {"nearly-sorted", gen_nearly_sorted},
+};
+
+#define N_SORT_INPUTS (int) (sizeof(sort_inputs) / sizeof(sort_inputs[0]))
+
+static void sort_ascend(struct list_head *head)
+{
+    q_sort(head, false);
+}
+
+static void list_sort_ascend(struct list_head *head)
+{
+    q_listSort(head, false);
+}
+
+static const struct {
+    const char *name;
+    void (*sort)(struct list_head *head);
+} sort_backends[N_SORT_BACKENDS] = {
+    {"q_sort", sort_ascend},
+    {"q_listSort", list_sort_ascend},
+};
+
+int find_sort_input(const char *name)
+{
+    for (int i = 0; i < N_SORT_INPUTS; i++) {
+        if (!strcmp(sort_inputs[i].name, name))
+            return i;
+    }
+    return -1;
+}
+
+const char *sort_input_name(int input)
+{
+    return sort_inputs[input].name;
+}
+
+int n_sort_inputs(void)
+{
+    return N_SORT_INPUTS;
+}
+
+const char *sort_backend_name(int backend)
+{
+    return sort_backends[backend].name;
+}
+
+static struct list_head *copy_queue(struct list_head *src)
+{
+    struct list_head *dst = q_new();
+    if (!dst)
+        return NULL;
+    element_t *e;
+    list_for_each_entry (e, src, list) {
+        if (!q_insert_tail(dst, e->value)) {
+            q_free(dst);
+            return NULL;
+        }
+    }
+    return dst;
+}
+
+static bool is_sorted(struct list_head *head)
+{
+    struct list_head *node;
+    list_for_each (node, head) {
+        if (node->next != head && cmp(node, node->next, false) > 0)
+            return false;
+    }
+    return true;
+}
+
+bool sort_bench(int input, int n, sort_result_t *res)
+{
+    struct list_head *src = q_new();
+    if (!src)
+        return false;
+    char buf[PREFIX_LEN + MAX_RANDOM_LEN + 1];
+    for (int i = 0; i < n; i++) {
+        sort_inputs[input].gen(buf, sizeof(buf), i, n);
+        if (!q_insert_tail(src, buf)) {
+            q_free(src);
+            return false;
+        }
+    }
+
+    for (int b = 0; b < N_SORT_BACKENDS; b++) {
+        struct list_head *q = copy_queue(src);
+        if (!q) {
+            q_free(src);
+            return false;
+        }
+
+        mem_stat_t before, after;
+        uint64_t start = 0;
+        get_memory_stat(&before);
+        uint64_t cmps = cmp_count;
+        init_time(&start);
+        sort_backends[b].sort(q);
+        res[b].ns = delta_time(&start);
+        res[b].cmps = cmp_count - cmps;
+        get_memory_stat(&after);
+        res[b].allocs = after.alloc_cnt - before.alloc_cnt;
+        res[b].sorted = is_sorted(q);
+        q_free(q);
+    }
+    q_free(src);
+    return true;
+}
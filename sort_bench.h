@@ -0,0 +1,34 @@
+#ifndef LAB0_SORT_BENCH_H
+#define LAB0_SORT_BENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Smallest and largest number of elements sorted by sortbench */
+#define SORT_BENCH_MIN 1000
+#define SORT_BENCH_MAX 10000000
+
+/* Outcome of one sort backend on one input */
+typedef struct {
+    uint64_t ns;    /* Time of the sort */
+    uint64_t cmps;  /* Calls of cmp() */
+    size_t allocs;  /* Allocations made while sorting */
+    bool sorted;    /* Whether the queue came out in ascending order */
+} sort_result_t;
+
+/* Shapes of input, -1 if name is not one of them */
+int find_sort_input(const char *name);
+const char *sort_input_name(int input);
+int n_sort_inputs(void);
+
+/* Sort functions compared by the benchmark, q_sort and q_listSort */
+#define N_SORT_BACKENDS 2
+const char *sort_backend_name(int backend);
+
+/* Build n elements of shape input and sort a copy of them with every
+ * backend, filling in res[backend]. Return false if memory ran out.
+ */
+bool sort_bench(int input, int n, sort_result_t *res);
+
+#endif /* LAB0_SORT_BENCH_H */
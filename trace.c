@@ -0,0 +1,296 @@
+/* Compiler of traces into a stream of operations, see trace.h.
+ *
+ * A compiled file is only meant to be replayed on the machine which wrote
+ * it, so fields are in native byte order.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "console.h"
+#include "report.h"
+#include "trace.h"
+
+/* Nesting of source commands followed by the compiler */
+#define MAX_SOURCE_DEPTH 16
+
+/* Argument shape of the commands replayed directly. A command line of any
+ * other shape is left to the console, which reports the error.
+ */
+static const struct {
+    const char *name;
+    trace_code_t code;
+    int min_argc, max_argc;
+    int str_arg; /* Word with the string argument, 0 for none */
+    int int_arg; /* Word parsed into num, 0 for none */
+} trace_shapes[] = {
+    {"ih", TRACE_IH, 2, 3, 1, 2},
+    {"it", TRACE_IT, 2, 3, 1, 2},
+    {"rh", TRACE_RH, 1, 2, 1, 0},
+    {"rt", TRACE_RT, 1, 2, 1, 0},
+    {"size", TRACE_SIZE, 1, 2, 0, 1},
+    {"sort", TRACE_SORT, 1, 1, 0, 0},
+    {"reverse", TRACE_REVERSE, 1, 1, 0, 0},
+    {"swap", TRACE_SWAP, 1, 1, 0, 0},
+    {"dedup", TRACE_DEDUP, 1, 1, 0, 0},
+    {"dm", TRACE_DM, 1, 1, 0, 0},
+    {"ascend", TRACE_ASCEND, 1, 1, 0, 0},
+    {"descend", TRACE_DESCEND, 1, 1, 0, 0},
+    {"reverseK", TRACE_REVERSEK, 2, 2, 0, 1},
+};
+
+#define N_TRACE_SHAPES (int) (sizeof(trace_shapes) / sizeof(trace_shapes[0]))
+
+/* Trace being compiled, grown by doubling */
+typedef struct {
+    trace_op_t *ops;
+    size_t ops_cap;
+    char *strings;
+    size_t strings_cap;
+    trace_header_t header;
+    int depth; /* Of repeat blocks */
+} builder_t;
+
+static bool grow(void **p, size_t *cap, size_t need, size_t size)
+{
+    if (need <= *cap)
+        return true;
+    size_t ncap = *cap ? *cap : 64;
+    while (ncap < need)
+        ncap *= 2;
+    void *np = realloc(*p, ncap * size);
+    if (!np) {
+        report(1, "Out of memory compiling trace");
+        return false;
+    }
+    *p = np;
+    *cap = ncap;
+    return true;
+}
+
+/* Fill in op from the words of one command line */
+static void compile_op(trace_op_t *op, int argc, char *argv[])
+{
+    op->code = TRACE_CMD;
+    op->flags = 0;
+    op->num = 1;
+    op->str = op->args;
+    for (int i = 0; i < N_TRACE_SHAPES; i++) {
+        if (strcmp(trace_shapes[i].name, argv[0]))
+            continue;
+        if (argc < trace_shapes[i].min_argc || argc > trace_shapes[i].max_argc)
+            return;
+        int a = trace_shapes[i].int_arg;
+        if (a && argc > a && !get_int(argv[a], &op->num))
+            return;
+        a = trace_shapes[i].str_arg;
+        if (a && argc > a) {
+            op->flags |= strcmp(argv[a], "RAND") ? TRACE_HAS_STR : TRACE_RAND;
+            op->str = op->args + (argv[a] - argv[0]);
+        }
+        op->code = trace_shapes[i].code;
+        return;
+    }
+}
+
+static bool compile_file(builder_t *b, const char *src, int depth);
+
+/* Add the command on line to b. The words are split in place. */
+static bool compile_line(builder_t *b, char *line, int depth)
+{
+    size_t len = strlen(line);
+    if (!grow((void **) &b->strings, &b->strings_cap,
+              b->header.strings_size + len + 1, 1))
+        return false;
+
+    /* Copy the words packed, each ended by '\0' */
+    char *words = b->strings + b->header.strings_size;
+    char *w = words;
+    int argc = 0;
+    for (char *p = line; *p;) {
+        while (isspace((unsigned char) *p))
+            p++;
+        if (!*p)
+            break;
+        while (*p && !isspace((unsigned char) *p))
+            *w++ = *p++;
+        *w++ = '\0';
+        argc++;
+    }
+    if (!argc)
+        return true;
+    if (argc > UINT16_MAX) {
+        report(1, "Too many words on a line of trace");
+        return false;
+    }
+
+    char **argv = malloc_or_fail(argc * sizeof(char *), "compile_line");
+    w = words;
+    for (int i = 0; i < argc; i++) {
+        argv[i] = w;
+        w += strlen(w) + 1;
+    }
+
+    bool ok = true;
+    if (!strcmp(argv[0], "source") && argc >= 2) {
+        /* Inlined, so that the commands run in the order of the trace. The
+         * name is copied, as the strings it lies in are reused and moved.
+         */
+        char *name = strsave_or_fail(argv[1], "compile_line");
+        ok = compile_file(b, name, depth + 1);
+        free_string(name);
+    } else if (grow((void **) &b->ops, &b->ops_cap, b->header.n_ops + 1,
+                    sizeof(trace_op_t))) {
+        trace_op_t *op = &b->ops[b->header.n_ops++];
+        op->argc = argc;
+        op->args = b->header.strings_size;
+        compile_op(op, argc, argv);
+        /* The console records the commands of repeat blocks and substitutes
+         * variables, so those are left to it.
+         */
+        bool vars = false;
+        for (int i = 0; i < argc; i++)
+            vars |= strchr(argv[i], '$') != NULL;
+        if (!strcmp(argv[0], "repeat"))
+            b->depth++;
+        else if (!strcmp(argv[0], "}") && b->depth)
+            b->depth--;
+        else if (b->depth || vars)
+            op->code = TRACE_CMD;
+        b->header.strings_size += w - words;
+        if ((uint32_t) argc > b->header.max_argc)
+            b->header.max_argc = argc;
+    } else {
+        ok = false;
+    }
+    free_block(argv, argc * sizeof(char *));
+    return ok;
+}
+
+static bool compile_file(builder_t *b, const char *src, int depth)
+{
+    if (depth > MAX_SOURCE_DEPTH) {
+        report(1, "Sources nested deeper than %d in '%s'", MAX_SOURCE_DEPTH,
+               src);
+        return false;
+    }
+    FILE *f = fopen(src, "r");
+    if (!f) {
+        report(1, "Could not open trace '%s'", src);
+        return false;
+    }
+
+    bool ok = true;
+    char *line = NULL;
+    size_t cap = 0;
+    while (ok && getline(&line, &cap, f) != -1)
+        ok = compile_line(b, line, depth);
+    free(line);
+    fclose(f);
+    return ok;
+}
+
+bool trace_compile(const char *src, const char *dst)
+{
+    builder_t b;
+    memset(&b, 0, sizeof(b));
+    memcpy(b.header.magic, TRACE_MAGIC, sizeof(b.header.magic));
+    b.header.version = TRACE_VERSION;
+
+    bool ok = compile_file(&b, src, 0);
+    if (ok) {
+        FILE *f = fopen(dst, "wb");
+        if (!f) {
+            report(1, "Could not create '%s'", dst);
+            ok = false;
+        } else {
+            ok = fwrite(&b.header, sizeof(b.header), 1, f) == 1 &&
+                 fwrite(b.ops, sizeof(trace_op_t), b.header.n_ops, f) ==
+                     b.header.n_ops &&
+                 fwrite(b.strings, 1, b.header.strings_size, f) ==
+                     b.header.strings_size;
+            if (fclose(f) || !ok) {
+                report(1, "Could not write '%s'", dst);
+                ok = false;
+            }
+        }
+    }
+    if (ok)
+        report(2, "Compiled %u commands of '%s' into '%s'", b.header.n_ops, src,
+               dst);
+    free(b.ops);
+    free(b.strings);
+    return ok;
+}
+
+bool trace_load(const char *file_name, trace_t *t)
+{
+    memset(t, 0, sizeof(*t));
+    FILE *f = fopen(file_name, "rb");
+    if (!f) {
+        report(1, "Could not open compiled trace '%s'", file_name);
+        return false;
+    }
+
+    trace_header_t *h = &t->header;
+    bool ok = fread(h, sizeof(*h), 1, f) == 1 &&
+              !memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic));
+    if (!ok) {
+        report(1, "'%s' is not a compiled trace", file_name);
+    } else if (h->version != TRACE_VERSION) {
+        report(1, "'%s' is of version %u, not %u", file_name, h->version,
+               TRACE_VERSION);
+        ok = false;
+    } else {
+        t->ops = malloc(h->n_ops * sizeof(trace_op_t) + 1);
+        t->strings = malloc(h->strings_size + 1);
+        ok = t->ops && t->strings &&
+             fread(t->ops, sizeof(trace_op_t), h->n_ops, f) == h->n_ops &&
+             fread(t->strings, 1, h->strings_size, f) == h->strings_size;
+        if (!ok)
+            report(1, "Could not read compiled trace '%s'", file_name);
+    }
+    fclose(f);
+
+    /* With the strings terminated, strlen() cannot run past their end */
+    if (ok && h->strings_size && t->strings[h->strings_size - 1] != '\0') {
+        report(1, "Compiled trace '%s' is corrupt", file_name);
+        ok = false;
+    }
+    /* Offsets are trusted from here on, down to each word of the arguments */
+    for (uint32_t i = 0; ok && i < h->n_ops; i++) {
+        const trace_op_t *op = &t->ops[i];
+        ok = op->code < N_TRACE_OPS && op->argc <= h->max_argc &&
+             op->str < h->strings_size;
+        uint32_t w = op->args;
+        for (int j = 0; ok && j < op->argc; j++) {
+            ok = w < h->strings_size;
+            if (ok)
+                w += strlen(t->strings + w) + 1;
+        }
+        if (!ok)
+            report(1, "Compiled trace '%s' is corrupt at op %u", file_name, i);
+    }
+    if (!ok)
+        trace_free(t);
+    return ok;
+}
+
+void trace_free(trace_t *t)
+{
+    free(t->ops);
+    free(t->strings);
+    t->ops = NULL;
+    t->strings = NULL;
+}
+
+void trace_argv(const trace_t *t, const trace_op_t *op, char **argv)
+{
+    char *w = t->strings + op->args;
+    for (int i = 0; i < op->argc; i++) {
+        argv[i] = w;
+        w += strlen(w) + 1;
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef LAB0_TRACE_H
+#define LAB0_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compiled traces: the commands of a .cmd file turned into a stream of fixed
+ * size operations, with command IDs and integer arguments parsed once. The
+ * queue commands can then be replayed straight against the queue API, while
+ * every other command keeps its words to be run by the console.
+ */
+
+#define TRACE_MAGIC "QTRC"
+#define TRACE_VERSION 1
+
+/* Operations replayed without the console */
+typedef enum {
+    TRACE_CMD, /* Any other command, run by the console */
+    TRACE_IH,
+    TRACE_IT,
+    TRACE_RH,
+    TRACE_RT,
+    TRACE_SIZE,
+    TRACE_SORT,
+    TRACE_REVERSE,
+    TRACE_SWAP,
+    TRACE_DEDUP,
+    TRACE_DM,
+    TRACE_ASCEND,
+    TRACE_DESCEND,
+    TRACE_REVERSEK,
+    N_TRACE_OPS,
+} trace_code_t;
+
+/* Flags of an operation */
+#define TRACE_RAND 0x1    /* Insert random strings */
+#define TRACE_HAS_STR 0x2 /* str is the string to insert or expect */
+
+typedef struct {
+    uint8_t code;  /* trace_code_t */
+    uint8_t flags; /* TRACE_RAND, TRACE_HAS_STR */
+    uint16_t argc; /* Words of the command line */
+    int32_t num;   /* Repetitions, or K of reverseK */
+    uint32_t args; /* Offset of the argc '\0' terminated words in strings */
+    uint32_t str;  /* Offset of the string argument in strings */
+} trace_op_t;
+
+/* Layout of a compiled file: this header, n_ops operations, then strings */
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t n_ops;
+    uint32_t strings_size;
+    uint32_t max_argc; /* Most words of any command */
+} trace_header_t;
+
+typedef struct {
+    trace_header_t header;
+    trace_op_t *ops;
+    char *strings;
+} trace_t;
+
+/* Compile the commands of trace file src, with the files it sources inlined,
+ * into dst. Return false and report why on failure.
+ */
+bool trace_compile(const char *src, const char *dst);
+
+/* Read a compiled trace, return false and report why on failure */
+bool trace_load(const char *file_name, trace_t *t);
+
+void trace_free(trace_t *t);
+
+/* Fill argv with the words of op, which has at most header.max_argc */
+void trace_argv(const trace_t *t, const trace_op_t *op, char **argv);
+
+#endif /* LAB0_TRACE_H */
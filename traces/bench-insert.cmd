@@ -0,0 +1,10 @@
+# Benchmark insertion and removal at both ends of a queue of $N strings
+# bench: N=100000
+option fail 0
+option malloc 0
+new
+ih RAND $N
+it RAND $N
+size
+reverse
+free
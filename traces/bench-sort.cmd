@@ -0,0 +1,11 @@
+# Benchmark sort of $N random strings, then of the sorted and reversed queue
+# bench: N=100000
+option fail 0
+option malloc 0
+new
+ih RAND $N
+sort
+sort
+reverse
+sort
+free
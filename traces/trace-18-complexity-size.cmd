@@ -0,0 +1,5 @@
+# Test if q_size, q_reverse, q_reverseK and q_delete_mid scale linearly
+complexity size
+complexity reverse
+complexity reverseK 3
+complexity delete_mid
@@ -0,0 +1,4 @@
+# Test if q_sort scales as n log n, and q_dedup and q_ascend linearly
+complexity sort
+complexity dedup
+complexity ascend
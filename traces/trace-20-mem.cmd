@@ -0,0 +1,16 @@
+# Test of memory accounting of queue allocations, with timed commands
+option fail 0
+option malloc 0
+new
+mem reset
+ih dolphin 1000
+it gerbil 100
+mem
+time rh dolphin
+time -r 3 it bear
+mem
+reverse
+free
+mem
+mem reset
+mem
@@ -0,0 +1,32 @@
+# Test of queue operations with every allocation against a guard page
+option fail 0
+option malloc 0
+new
+ih dolphin
+it bear
+option guard 1
+ih gerbil 3
+it meerkat 5
+it zebra
+ih a
+reverse
+sort
+dedup
+descend
+rh zebra
+new
+ih RAND 100
+sort
+reverseK 4
+dm
+free
+option fail 30
+option malloc 50
+ih lion 20
+option malloc 0
+option fail 0
+free
+option guard 0
+new
+ih vulture
+rh vulture
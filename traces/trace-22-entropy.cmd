@@ -0,0 +1,13 @@
+# Test of Shannon entropy over a whole queue
+option fail 0
+option malloc 0
+new
+entropy
+ih aaaaaaaa
+entropy
+it abcdefgh
+it RAND 1000
+entropy
+reverse
+entropy
+free
@@ -0,0 +1,8 @@
+# Test of compiling a trace, then replaying it with and without command checks
+option fail 0
+option malloc 0
+compile traces/trace-06-ops.cmd /tmp/qtest.trace-23
+replay /tmp/qtest.trace-23
+free
+replay /tmp/qtest.trace-23 check
+free
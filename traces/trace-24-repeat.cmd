@@ -0,0 +1,28 @@
+# Test of repeat blocks, nested and counting in a variable
+option fail 0
+option malloc 0
+new
+repeat 3 I {
+    it a$I
+}
+repeat 2 {
+    repeat 2 J {
+        ih b$J
+    }
+}
+repeat 0 {
+    ih never
+}
+rh b1
+rh b0
+rh b1
+rh b0
+rt a2
+rt a1
+rt a0
+repeat 100000 {
+    it RAND
+    rh
+}
+size
+free
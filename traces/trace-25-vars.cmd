@@ -0,0 +1,24 @@
+# Test of variables, set and counted with incr, substituted in any command
+option fail 0
+option malloc 0
+set N 2
+set V gerbil
+new
+ih $V $N
+incr N
+it n$N
+incr N -4
+it n$N
+set W x$V
+it $W
+rh gerbil
+rh gerbil
+rt xgerbil
+rt n-1
+rt n3
+set N 4
+repeat $N I {
+    incr N $I
+}
+it n$N
+rh n10
@@ -0,0 +1,13 @@
+# Test of reading commands from sourced files, resuming this one after each
+option fail 0
+option malloc 0
+new
+ih a
+source traces/trace-06-ops.cmd
+it b
+source traces/trace-24-repeat.cmd
+new
+it c
+source traces/trace-25-vars.cmd
+it d
+rt d
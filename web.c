@@ -3,78 +3,161 @@
  */
 
 #include <arpa/inet.h> /* inet_ntoa */
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+/* poll() stands in for epoll */
+#define EPOLLIN POLLIN
+#define EPOLLOUT POLLOUT
+#define EPOLLHUP POLLHUP
+#define EPOLLERR POLLERR
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+#endif
+
+#include "metrics.h"
+#include "report.h"
+#include "web.h"
+
 #define LISTENQ 1024 /* second argument to listen() */
 #define MAXLINE 1024 /* max length of a line */
-#define BUFSIZE 1024
 
 #ifndef DEFAULT_PORT
 #define DEFAULT_PORT 9999 /* use this port if none given as arg to main() */
 #endif
 
-#if defined(__APPLE__) || defined(__FreeBSD__)
-#define TCP_CORK TCP_NOPUSH
-#endif
+/* Clients served at once, more wait in the backlog of listen() */
+#define MAX_CONNS 256
 
-static int server_fd;
+/* Largest request, headers and body, that a connection may buffer */
+#define MAX_REQUEST (1 << 20)
 
-typedef struct {
-    int fd;            /* descriptor for this buf */
-    int count;         /* unread byte in this buf */
-    char *bufptr;      /* next unread byte in this buf */
-    char buf[BUFSIZE]; /* internal buffer */
-} rio_t;
+/* Bytes read from a connection at a time */
+#define READ_CHUNK 16384
+
+/* Output sent as a chunk once this much has been captured */
+#define OUT_CHUNK 65536
+
+/* Output a connection may have unsent before its requests wait for it */
+#define MAX_PENDING (4 << 20)
+
+/* Width of the size of a chunk, written once the chunk is complete */
+#define CHUNK_DIGITS 8
+
+static int server_fd = -1;
 
+/* Run a command line for a client, tell whether the console quit, and the
+ * size of the queue
+ */
+static web_cmd_func_t run_cmd_fn;
+static bool (*done_fn)(void);
+static int (*size_fn)(void);
+
+/* Switch to the queues of a session */
+static bool (*session_fn)(const char *id);
+
+/* A request parsed in the input of its connection. The command of the path
+ * is decoded in place there, and the body is left where it arrived.
+ */
 typedef struct {
-    char filename[512];
+    char *cmd;
+    size_t cmd_len;
     off_t offset; /* for support Range */
     size_t end;
+    bool keep_alive;
+    bool http11; /* Responses may be chunked */
+    bool json; /* Results are wanted in JSON */
+    char session[WEB_SESSION_LEN + 1];
+    bool set_cookie; /* Session named in the URL, to be kept in a cookie */
+    char *body; /* Commands sent in the body, one per line */
+    size_t body_len;
 } http_request_t;
 
-static void rio_readinitb(rio_t *rp, int fd)
-{
-    rp->fd = fd;
-    rp->count = 0;
-    rp->bufptr = rp->buf;
-}
+/* A client connection. Requests are read into in, which keeps what follows
+ * the last complete one, so that pipelined requests are answered in order,
+ * and responses queue up in out until the socket takes them.
+ */
+typedef struct {
+    int fd; /* -1 for a free slot */
+    char *in;
+    size_t in_len, in_cap;
+    size_t scanned; /* Of in, for the end of the headers */
+    char *out;
+    size_t out_len, out_sent, out_cap;
+    bool closing; /* Close once out is sent */
+    bool want_in; /* Reading requests, i.e. not too much output is unsent */
+    bool held; /* Requests in in wait for out to drain */
+    bool want_out; /* Waiting for the socket to be writable */
+    /* Response being written */
+    bool chunked, json;
+    size_t chunk_start; /* Offset in out of the open chunk */
+    /* Request run by a worker, which owns the connection until it is done.
+     * Its words stay in in, which is not read meanwhile.
+     */
+    bool busy;
+    http_request_t job;
+    size_t job_end;  /* Of in, where the requests after it start */
+    int next_job;    /* Next connection in the list it is in, -1 if last */
+} web_conn_t;
 
-/* This is a wrapper for the Unix read() function that transfers min(n, count)
- * bytes from an internal buffer to a user buffer, where n is the number of
- * bytes requested by the user and count is the number of unread bytes in the
- * internal buffer. On entry, rio_read() refills the internal buffer via a call
- * to read() if the internal buffer is empty.
+static web_conn_t conns[MAX_CONNS];
+
+#ifdef __linux__
+static int epoll_fd = -1;
+#endif
+
+/* Connection the output of the running command goes to, if any */
+static __thread web_conn_t *capture_conn;
+
+/* Workers running the requests of sessions. Each session goes to the worker
+ * its id hashes to, and its requests queue up there in order, so that its
+ * queues are only ever touched by the thread which allocated them.
  */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
-{
-    int cnt;
-    while (rp->count <= 0) { /* refill if buf is empty */
-        rp->count = read(rp->fd, rp->buf, sizeof(rp->buf));
-        if (rp->count < 0) {
-            if (errno != EINTR) /* interrupted by sig handler return */
-                return -1;
-        } else if (rp->count == 0) { /* EOF */
-            return 0;
-        } else
-            rp->bufptr = rp->buf; /* reset buffer ptr */
-    }
-
-    /* Copy min(n, rp->count) bytes from internal buf to user buf */
-    cnt = n;
-    if (rp->count < n)
-        cnt = rp->count;
-    memcpy(usrbuf, rp->bufptr, cnt);
-    rp->bufptr += cnt;
-    rp->count -= cnt;
-    return cnt;
-}
+typedef struct {
+    pthread_t thread;
+    int first, last; /* Connections whose requests wait, -1 if none */
+    bool ok;         /* Whether it cleaned up as it stopped */
+} worker_t;
+
+static worker_t workers[WEB_MAX_WORKERS];
+static int n_workers = 0;
+static bool (*worker_stop_fn)(void);
+
+/* Guards the lists of connections and the state of the pool */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_idle = PTHREAD_COND_INITIALIZER;
+static int pool_paused = 0;  /* Depth of web_pause */
+static int pool_running = 0; /* Requests being run by workers */
+static bool pool_stop = false;
+static int finished = -1; /* Connections whose request was run */
+
+/* Written by workers as they finish a request, to wake the event loop */
+static int wake_fds[2] = {-1, -1};
+
+static __thread bool is_worker = false;
+
+/* Tags of the events which are not about a connection */
+#define TAG_LISTEN MAX_CONNS
+#define TAG_STDIN (MAX_CONNS + 1)
+#define TAG_WAKE (MAX_CONNS + 2)
 
 static ssize_t writen(int fd, void *usrbuf, size_t n)
 {
@@ -95,32 +178,11 @@ static ssize_t writen(int fd, void *usrbuf, size_t n)
     return n;
 }
 
-/* robustly read a text line (buffered) */
-static ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+static void set_nonblock(int fd)
 {
-    char c, *bufp = usrbuf;
-
-    int n;
-    for (n = 1; n < maxlen; n++) {
-        int rc;
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            break;        /* EOF, some data was read */
-        } else
-            return -1; /* error */
-    }
-    *bufp = 0;
-    return n;
-}
-
-void web_send(int out_fd, char *buf)
-{
-    writen(out_fd, buf, strlen(buf));
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags >= 0)
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
 int web_open(int port)
@@ -137,12 +199,6 @@ int web_open(int port)
                    sizeof(int)) < 0)
         return -1;
 
-    // 6 is TCP's protocol number
-    // enable this, much faster : 4000 req/s -> 17000 req/s
-    if (setsockopt(listenfd, IPPROTO_TCP, TCP_CORK, (const void *) &optval,
-                   sizeof(int)) < 0)
-        return -1;
-
     /* Listenfd will be an endpoint for all requests to port
        on any IP address for this host */
     memset(&serveraddr, 0, sizeof(serveraddr));
@@ -155,116 +211,1018 @@ int web_open(int port)
     /* Make it a listening socket ready to accept connection requests */
     if (listen(listenfd, LISTENQ) < 0)
         return -1;
+    set_nonblock(listenfd);
+
+    /* A client gone while its responses are sent makes writes fail with
+     * EPIPE, and the connection is closed, instead of killing qtest
+     */
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < MAX_CONNS; i++)
+        conns[i].fd = -1;
+#ifdef __linux__
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+        return -1;
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = TAG_LISTEN};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+        return -1;
+#endif
 
     server_fd = listenfd;
 
     return listenfd;
 }
 
-static void url_decode(char *src, char *dest, int max)
+void web_set_cmd(web_cmd_func_t run, bool (*done)(void), int (*size)(void))
+{
+    run_cmd_fn = run;
+    done_fn = done;
+    size_fn = size;
+}
+
+void web_set_session(bool (*enter)(const char *id))
+{
+    session_fn = enter;
+}
+
+/* Copy the value of name in a list of name=value items ended by sep, up to
+ * the end of the line, into val of len bytes. Return false if name is not
+ * there or its value does not fit.
+ */
+static bool list_value(const char *list, char sep, const char *name, char *val,
+                       size_t len)
+{
+    size_t name_len = strlen(name);
+    for (const char *p = list; *p && *p != '\r' && *p != '\n';) {
+        while (*p == ' ')
+            p++;
+        size_t n = strcspn(p, "\r\n;&");
+        if (n > name_len && !strncmp(p, name, name_len) && p[name_len] == '=') {
+            n -= name_len + 1;
+            if (n >= len)
+                return false;
+            memcpy(val, p + name_len + 1, n);
+            val[n] = '\0';
+            return true;
+        }
+        p += n;
+        if (*p != sep)
+            break;
+        p++;
+    }
+    return false;
+}
+
+static bool valid_session(const char *id)
+{
+    for (; *id; id++) {
+        if (!isalnum((unsigned char) *id) && *id != '-' && *id != '_')
+            return false;
+    }
+    return true;
+}
+
+static int hex_value(char c)
+{
+    return isdigit((unsigned char) c) ? c - '0'
+                                      : tolower((unsigned char) c) - 'a' + 10;
+}
+
+/* Decode the escapes of path in place, making '/' a space, as it separates
+ * the words of a command. Return the decoded length.
+ */
+static size_t decode_path(char *path)
 {
-    char *p = src;
-    char code[3] = {0};
-    while (*p && --max) {
-        if (*p == '%') {
-            memcpy(code, ++p, 2);
-            *dest++ = (char) strtoul(code, NULL, 16);
+    char *dst = path;
+    for (char *p = path; *p; p++) {
+        char c = *p;
+        if (c == '%' && isxdigit((unsigned char) p[1]) &&
+            isxdigit((unsigned char) p[2])) {
+            c = (char) (hex_value(p[1]) * 16 + hex_value(p[2]));
             p += 2;
-        } else {
-            *dest++ = *p++;
+        }
+        *dst++ = c == '/' ? ' ' : c;
+    }
+    *dst = '\0';
+    return dst - path;
+}
+
+/* Grow buffer *bufp of *capp bytes to hold need bytes */
+static bool reserve(char **bufp, size_t *capp, size_t need)
+{
+    if (need <= *capp)
+        return true;
+    size_t cap = *capp ? *capp : 4096;
+    while (cap < need)
+        cap *= 2;
+    char *buf = realloc(*bufp, cap);
+    if (!buf)
+        return false;
+    *bufp = buf;
+    *capp = cap;
+    return true;
+}
+
+static bool append(web_conn_t *c, const char *data, size_t len)
+{
+    if (!reserve(&c->out, &c->out_cap, c->out_len + len))
+        return false;
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    return true;
+}
+
+/* Whether word appears in the header line, in any case */
+static bool header_has(const char *line, const char *word)
+{
+    size_t len = strlen(word);
+    for (; *line && *line != '\n'; line++) {
+        if (!strncasecmp(line, word, len))
+            return true;
+    }
+    return false;
+}
+
+/* End of the headers of the request at buf, NULL if they are incomplete.
+ * The search starts at *scanned, and leaves there where to resume it.
+ */
+static char *headers_end(char *buf, size_t len, size_t *scanned, size_t *skip)
+{
+    for (char *p = buf + *scanned; (p = memchr(p, '\n', buf + len - p)); p++) {
+        if (p + 1 < buf + len && p[1] == '\n') {
+            *skip = 2;
+            return p;
+        }
+        if (p + 2 < buf + len && p[1] == '\r' && p[2] == '\n') {
+            *skip = 3;
+            return p;
         }
     }
-    *dest = '\0';
+    /* The end may be split across reads */
+    *scanned = len > 2 ? len - 2 : 0;
+    return NULL;
 }
 
-static void parse_request(int fd, http_request_t *req)
+/* Parse the request at buf, of which len bytes have arrived, in place.
+ * Return its length, 0 if it is not complete yet, or -1 if it is malformed.
+ * What was scanned of an incomplete request is kept in *scanned, so that
+ * each byte is searched once however the request is split.
+ */
+static ssize_t parse_request(char *buf,
+                             size_t len,
+                             size_t *scanned,
+                             http_request_t *req)
 {
-    rio_t rio;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
+    size_t skip;
+    char *end = headers_end(buf, len, scanned, &skip);
+    if (!end)
+        return len > MAX_REQUEST ? -1 : 0;
+    *scanned = end - buf;
+    size_t head_len = end + skip - buf;
+
+    /* Headers are scanned as strings, which a NUL byte would cut short */
+    if (memchr(buf, '\0', end - buf))
+        return -1;
+
+    /* The body must be there as well before anything is changed */
+    size_t body_len = 0;
+    for (char *line = buf; line < end; line = strchr(line, '\n') + 1) {
+        if (!strncasecmp(line, "Content-Length:", 15))
+            body_len = strtoul(line + 15, NULL, 10);
+    }
+    if (body_len > MAX_REQUEST)
+        return -1;
+    if (len < head_len + body_len)
+        return 0;
+
+    /* The request line and its words are ended in place */
+    *end = '\0';
+    char *line_end = strchr(buf, '\n');
+    char *headers = line_end ? line_end + 1 : NULL;
+    if (!line_end)
+        line_end = end;
+    *line_end = '\0';
+    if (line_end > buf && line_end[-1] == '\r')
+        line_end[-1] = '\0';
+    char *save;
+    char *method = strtok_r(buf, " ", &save);
+    char *uri = strtok_r(NULL, " ", &save);
+    char *version = strtok_r(NULL, " ", &save);
+    if (!method || !uri)
+        return -1;
+
     req->offset = 0;
     req->end = 0; /* default */
-
-    rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%1023s %1023s", method, uri); /* version is not cared */
-    /* read all */
-    while (buf[0] != '\n' && buf[1] != '\n') { /* \n || \r\n */
-        rio_readlineb(&rio, buf, MAXLINE);
-        if (buf[0] == 'R' && buf[1] == 'a' && buf[2] == 'n') {
-            sscanf(buf, "Range: bytes=%lu-%lu", (unsigned long *) &req->offset,
-                   (unsigned long *) &req->end);
-            /* Range: [start, end] */
-            if (req->end != 0)
-                req->end++;
+    req->http11 = version && !strncmp(version, "HTTP/1.1", 8);
+    req->keep_alive = req->http11;
+    req->json = false;
+    req->session[0] = '\0';
+    req->set_cookie = false;
+    for (char *line = headers; line && *line;) {
+        if (!strncasecmp(line, "Range:", 6)) {
+            /* Range: bytes=start-end, end included */
+            char *p = line + 6 + strspn(line + 6, " ");
+            if (!strncasecmp(p, "bytes=", 6)) {
+                req->offset = strtoul(p + 6, &p, 10);
+                if (*p == '-' && isdigit((unsigned char) p[1]))
+                    req->end = strtoul(p + 1, NULL, 10) + 1;
+            }
+        } else if (!strncasecmp(line, "Connection:", 11)) {
+            /* Without chunks, the end of a response is told by closing */
+            if (header_has(line, "close"))
+                req->keep_alive = false;
+        } else if (!strncasecmp(line, "Accept:", 7)) {
+            req->json = header_has(line, "application/json");
+        } else if (!strncasecmp(line, "Cookie:", 7)) {
+            list_value(line + 7, ';', "session", req->session,
+                       sizeof(req->session));
         }
+        line = strchr(line, '\n');
+        if (line)
+            line++;
     }
-    char *filename = uri;
-    if (uri[0] == '/') {
-        filename = uri + 1;
-        int length = strlen(filename);
-        if (length == 0) {
-            filename = ".";
-        } else {
-            for (int i = 0; i < length; ++i) {
-                if (filename[i] == '?') {
-                    filename[i] = '\0';
-                    break;
-                }
+
+    char *path = uri[0] == '/' ? uri + 1 : uri;
+    char *query = strchr(path, '?');
+    if (query) {
+        *query++ = '\0';
+        char format[8];
+        if (list_value(query, '&', "format", format, sizeof(format)))
+            req->json = !strcmp(format, "json");
+        if (list_value(query, '&', "session", req->session,
+                       sizeof(req->session)))
+            req->set_cookie = true;
+    }
+    if (!valid_session(req->session))
+        return -1;
+    req->cmd = path;
+    req->cmd_len = decode_path(path);
+
+    req->body = buf + head_len;
+    req->body_len = body_len;
+    return head_len + body_len;
+}
+
+/* Make the text from offset start of the output of c a JSON string, in
+ * place, growing it from the end
+ */
+static bool escape_json(web_conn_t *c, size_t start)
+{
+    size_t extra = 0;
+    for (size_t i = start; i < c->out_len; i++) {
+        unsigned char ch = c->out[i];
+        if (ch == '"' || ch == '\\' || ch == '\n' || ch == '\r' || ch == '\t')
+            extra += 1;
+        else if (ch < 0x20)
+            extra += 5;
+    }
+    if (!extra)
+        return true;
+    if (!reserve(&c->out, &c->out_cap, c->out_len + extra + 1))
+        return false;
+
+    char *src = c->out + c->out_len, *dst = src + extra;
+    c->out_len += extra;
+    while (src > c->out + start) {
+        unsigned char ch = *--src;
+        const char *esc = NULL;
+        char hex[7];
+        switch (ch) {
+        case '"':
+            esc = "\\\"";
+            break;
+        case '\\':
+            esc = "\\\\";
+            break;
+        case '\n':
+            esc = "\\n";
+            break;
+        case '\r':
+            esc = "\\r";
+            break;
+        case '\t':
+            esc = "\\t";
+            break;
+        default:
+            if (ch < 0x20) {
+                snprintf(hex, sizeof(hex), "\\u%04x", ch);
+                esc = hex;
             }
         }
+        if (!esc) {
+            *--dst = ch;
+            continue;
+        }
+        size_t len = strlen(esc);
+        dst -= len;
+        memcpy(dst, esc, len);
     }
-    url_decode(filename, req->filename, MAXLINE);
+    return true;
 }
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr)
+static void open_chunk(web_conn_t *c)
+{
+    c->chunk_start = c->out_len;
+    if (c->chunked)
+        append(c, "00000000\r\n", CHUNK_DIGITS + 2);
+}
+
+/* Fill in the size of the open chunk, or drop it if it is empty, as an empty
+ * chunk would end the response
+ */
+static void close_chunk(web_conn_t *c)
 {
-    http_request_t req;
-    parse_request(fd, &req);
+    if (!c->chunked)
+        return;
+    size_t size = c->out_len - c->chunk_start - (CHUNK_DIGITS + 2);
+    if (!size) {
+        c->out_len = c->chunk_start;
+        return;
+    }
+    /* Chunks are closed past OUT_CHUNK, well before 32 bits overflow */
+    char digits[CHUNK_DIGITS + 1];
+    snprintf(digits, sizeof(digits), "%0*x", CHUNK_DIGITS, (unsigned) size);
+    memcpy(c->out + c->chunk_start, digits, CHUNK_DIGITS);
+    append(c, "\r\n", 2);
+}
 
-    char *p = req.filename;
-    /* Change '/' to ' ' */
-    while (*p) {
-        ++p;
-        if (*p == '/')
-            *p = ' ';
+/* Send what the socket takes of the output of c while a command runs, so
+ * that little of it piles up with fast clients. Commands never wait for slow
+ * ones, whose following requests wait instead, see flush_conn. Errors are
+ * left to flush_conn.
+ */
+static void send_pending(web_conn_t *c)
+{
+    while (c->out_sent < c->out_len) {
+        ssize_t n =
+            write(c->fd, c->out + c->out_sent, c->out_len - c->out_sent);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        c->out_sent += n;
     }
-    char *ret = malloc(strlen(req.filename) + 1);
-    strncpy(ret, req.filename, strlen(req.filename) + 1);
+    /* No chunk is open, so nothing points into out */
+    if (c->out_sent == c->out_len)
+        c->out_len = c->out_sent = 0;
+}
 
-    return ret;
+bool web_capturing(void)
+{
+    return capture_conn != NULL;
 }
 
-int web_eventmux(char *buf)
+void web_vprintf(const char *fmt, va_list ap)
 {
-    fd_set listenset;
+    web_conn_t *c = capture_conn;
+    if (!c)
+        return;
 
-    FD_ZERO(&listenset);
-    FD_SET(STDIN_FILENO, &listenset);
-    int max_fd = STDIN_FILENO;
-    if (server_fd > 0) {
-        FD_SET(server_fd, &listenset);
-        max_fd = max_fd > server_fd ? max_fd : server_fd;
+    /* Formatted straight into the response */
+    va_list aq;
+    va_copy(aq, ap);
+    size_t room = c->out_cap - c->out_len;
+    int n = vsnprintf(c->out + c->out_len, room, fmt, aq);
+    va_end(aq);
+    if (n < 0)
+        return;
+    if ((size_t) n >= room) {
+        if (!reserve(&c->out, &c->out_cap, c->out_len + n + 1))
+            return;
+        va_copy(aq, ap);
+        vsnprintf(c->out + c->out_len, n + 1, fmt, aq);
+        va_end(aq);
     }
-    int result = select(max_fd + 1, &listenset, NULL, NULL, NULL);
-    if (result < 0)
-        return -1;
+    size_t start = c->out_len;
+    c->out_len += n;
+    if (c->json && !escape_json(c, start))
+        c->out_len = start;
 
-    if (server_fd > 0 && FD_ISSET(server_fd, &listenset)) {
-        FD_CLR(server_fd, &listenset);
+    if (c->out_len - c->chunk_start >= OUT_CHUNK) {
+        close_chunk(c);
+        send_pending(c);
+        open_chunk(c);
+    }
+}
+
+void web_printf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    web_vprintf(fmt, ap);
+    va_end(ap);
+}
+
+/* Run a command line, adding its output to the response */
+static void run_line(web_conn_t *c, char *line, size_t len, bool *first)
+{
+    while (len && (line[len - 1] == '\r' || line[len - 1] == '\n'))
+        len--;
+    if (!len)
+        return;
+
+    if (c->json) {
+        const char *open = *first ? "{\"cmd\":\"" : ",{\"cmd\":\"";
+        append(c, open, strlen(open));
+        size_t start = c->out_len;
+        if (append(c, line, len) && !escape_json(c, start))
+            c->out_len = start;
+        append(c, "\",\"output\":\"", 12);
+    }
+    *first = false;
+
+    uint64_t t;
+    init_time(&t);
+    capture_conn = c;
+    bool ok = run_cmd_fn(line, len);
+    capture_conn = NULL;
+    uint64_t ns = delta_time(&t);
+
+    if (c->json) {
+        char tail[MAXLINE];
+        int size = size_fn ? size_fn() : -1;
+        char size_text[16] = "null";
+        if (size >= 0)
+            snprintf(size_text, sizeof(size_text), "%d", size);
+        int n = snprintf(tail, sizeof(tail),
+                         "\",\"ok\":%s,\"size\":%s,\"time_ns\":%" PRIu64 "}",
+                         ok ? "true" : "false", size_text, ns);
+        append(c, tail, n);
+    }
+}
+
+static void error_response(web_conn_t *c, const char *status)
+{
+    char header[MAXLINE];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 %s\r\nContent-Length: 0\r\n"
+                     "Connection: close\r\n\r\n",
+                     status);
+    append(c, header, n);
+    c->closing = true;
+}
+
+static void metrics_vprintf(void *ctx, const char *fmt, va_list ap)
+{
+    web_vprintf(fmt, ap);
+}
+
+/* Answer GET /metrics with the metrics of the commands, for Prometheus */
+static void serve_metrics(web_conn_t *c, http_request_t *req)
+{
+    if (!req->keep_alive)
+        c->closing = true;
+    c->chunked = req->http11;
+    c->json = false;
+
+    char header[MAXLINE];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: text/plain; version=0.0.4\r\n%s%s\r\n",
+                     c->chunked ? "Transfer-Encoding: chunked\r\n" : "",
+                     c->closing ? "Connection: close\r\n" : "");
+    if (!append(c, header, n)) {
+        c->closing = true;
+        return;
+    }
+
+    open_chunk(c);
+    capture_conn = c;
+    metrics_export(metrics_vprintf, NULL);
+    capture_conn = NULL;
+    close_chunk(c);
+    if (c->chunked)
+        append(c, "0\r\n\r\n", 5);
+}
+
+static bool is_metrics(const http_request_t *req)
+{
+    return req->cmd_len == 7 && !memcmp(req->cmd, "metrics", 7) &&
+           !req->body_len;
+}
+
+/* Run the commands of a request, the one in the path, then those of the
+ * body, on the queues of its session, and queue the response with their
+ * output. Responses to HTTP/1.1 are chunked, so that output is sent while it
+ * is produced.
+ */
+static void serve_request(web_conn_t *c, http_request_t *req)
+{
+    if (is_metrics(req)) {
+        serve_metrics(c, req);
+        return;
+    }
+    if (session_fn && !session_fn(req->session)) {
+        error_response(c, "503 Service Unavailable");
+        return;
+    }
+    if (!req->keep_alive)
+        c->closing = true;
+    c->chunked = req->http11;
+    c->json = req->json;
+
+    char cookie[WEB_SESSION_LEN + 64] = "";
+    if (req->set_cookie)
+        snprintf(cookie, sizeof(cookie),
+                 "Set-Cookie: session=%s; Path=/\r\n", req->session);
+    char header[MAXLINE];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n%s%s%s\r\n",
+                     c->json ? "application/json" : "text/plain", cookie,
+                     c->chunked ? "Transfer-Encoding: chunked\r\n" : "",
+                     c->closing ? "Connection: close\r\n" : "");
+    if (!append(c, header, n)) {
+        c->closing = true;
+        if (session_fn)
+            session_fn(NULL);
+        return;
+    }
+
+    bool first = true;
+    open_chunk(c);
+    if (c->json)
+        append(c, "{\"results\":[", 12);
+    run_line(c, req->cmd, req->cmd_len, &first);
+    char *p = req->body, *end = req->body + req->body_len;
+    while (p < end && !done_fn()) {
+        char *eol = memchr(p, '\n', end - p);
+        char *next = eol ? eol + 1 : end;
+        run_line(c, p, next - p, &first);
+        p = next;
+    }
+    if (c->json)
+        append(c, "]}\n", 3);
+    close_chunk(c);
+    if (c->chunked)
+        append(c, "0\r\n\r\n", 5);
+    if (session_fn)
+        session_fn(NULL);
+}
+
+static void watch(int fd, uint32_t tag, bool in, bool out, int op)
+{
+#ifdef __linux__
+    struct epoll_event ev = {
+        .events = (in ? EPOLLIN : 0) | (out ? EPOLLOUT : 0),
+        .data.u32 = tag,
+    };
+    epoll_ctl(epoll_fd, op, fd, &ev);
+#endif
+}
+
+static void close_conn(web_conn_t *c)
+{
+#ifdef __linux__
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+#endif
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+/* Send what the socket takes of the responses, then watch it for room for
+ * the rest. While more than MAX_PENDING bytes are left, the connection is not
+ * read, so that a slow client holds back its own requests rather than the
+ * other clients and memory. Return false once the connection is closed.
+ */
+static bool flush_conn(web_conn_t *c)
+{
+    while (c->out_sent < c->out_len) {
+        ssize_t n =
+            write(c->fd, c->out + c->out_sent, c->out_len - c->out_sent);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            close_conn(c);
+            return false;
+        }
+        c->out_sent += n;
+    }
+    if (c->out_sent == c->out_len) {
+        c->out_len = c->out_sent = 0;
+        if (c->closing) {
+            close_conn(c);
+            return false;
+        }
+    }
+    bool want_in = c->out_len - c->out_sent <= MAX_PENDING;
+    bool want_out = c->out_len > 0;
+    if (want_in != c->want_in || want_out != c->want_out) {
+        watch(c->fd, c - conns, want_in, want_out, EPOLL_CTL_MOD);
+        c->want_in = want_in;
+        c->want_out = want_out;
+    }
+    return true;
+}
+
+static void accept_conns(void)
+{
+    for (;;) {
         struct sockaddr_in clientaddr;
         socklen_t clientlen = sizeof(clientaddr);
-        int web_connfd =
+        int fd =
             accept(server_fd, (struct sockaddr *) &clientaddr, &clientlen);
+        if (fd < 0)
+            return;
+
+        web_conn_t *c = NULL;
+        for (int i = 0; i < MAX_CONNS && !c; i++) {
+            if (conns[i].fd < 0)
+                c = &conns[i];
+        }
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        set_nonblock(fd);
+        /* Responses are written whole, so Nagle would only delay them */
+        int optval = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        c->want_in = true;
+        watch(fd, c - conns, true, false, EPOLL_CTL_ADD);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *w = arg;
+    is_worker = true;
+    /* Interrupts are for the console, while a time limit or a fault of a
+     * command is handled by the thread running it
+     */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (!pool_stop && (pool_paused || w->first < 0))
+            pthread_cond_wait(&pool_work, &pool_lock);
+        if (pool_stop)
+            break;
+        web_conn_t *c = &conns[w->first];
+        w->first = c->next_job;
+        if (w->first < 0)
+            w->last = -1;
+        pool_running++;
+        pthread_mutex_unlock(&pool_lock);
 
-        char *p = web_recv(web_connfd, &clientaddr);
-        char *buffer = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n";
-        web_send(web_connfd, buffer);
-        strncpy(buf, p, strlen(p) + 1);
-        free(p);
-        close(web_connfd);
-        return strlen(buf);
+        if (!done_fn()) {
+            serve_request(c, &c->job);
+            /* The response is complete, so no chunk is open */
+            send_pending(c);
+        }
+
+        pthread_mutex_lock(&pool_lock);
+        c->next_job = finished;
+        finished = c - conns;
+        if (!--pool_running)
+            pthread_cond_broadcast(&pool_idle);
+        ssize_t ret = write(wake_fds[1], "", 1);
+        (void) ret;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    w->ok = !worker_stop_fn || worker_stop_fn();
+    return NULL;
+}
+
+bool web_set_workers(int n, bool (*stop)(void))
+{
+    if (n_workers || n <= 0 || n > WEB_MAX_WORKERS)
+        return n == 0;
+#ifdef __linux__
+    if (pipe(wake_fds) < 0)
+        return false;
+    set_nonblock(wake_fds[0]);
+    set_nonblock(wake_fds[1]);
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = TAG_WAKE};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fds[0], &ev);
+
+    worker_stop_fn = stop;
+    pool_stop = false;
+    for (; n_workers < n; n_workers++) {
+        worker_t *w = &workers[n_workers];
+        w->first = w->last = -1;
+        if (pthread_create(&w->thread, NULL, worker_main, w)) {
+            web_stop_workers();
+            return false;
+        }
+    }
+    return true;
+#else
+    /* The time limit of a command is a timer of its thread on Linux only */
+    return false;
+#endif
+}
+
+bool web_stop_workers(void)
+{
+    if (!n_workers)
+        return true;
+    pthread_mutex_lock(&pool_lock);
+    pool_stop = true;
+    pthread_cond_broadcast(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+
+    bool ok = true;
+    for (int i = 0; i < n_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        ok = ok && workers[i].ok;
     }
+    n_workers = 0;
+    /* Requests which were still waiting are not answered */
+    finished = -1;
+    return ok;
+}
 
-    FD_CLR(STDIN_FILENO, &listenset);
-    return 0;
+bool web_worker(void)
+{
+    return is_worker;
+}
+
+void web_pause(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    pool_paused++;
+    while (pool_running)
+        pthread_cond_wait(&pool_idle, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void web_resume(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    if (pool_paused && !--pool_paused)
+        pthread_cond_broadcast(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* Hand request req of c, which ends at end of its input, to the worker of
+ * its session. Return false if it is to be served here: with no workers, for
+ * session "", which is the console's, and for the metrics.
+ */
+static bool dispatch(web_conn_t *c, http_request_t *req, size_t end)
+{
+    if (!n_workers || !req->session[0] || is_metrics(req))
+        return false;
+
+    /* FNV-1a */
+    uint32_t h = 2166136261u;
+    for (const char *p = req->session; *p; p++)
+        h = (h ^ (unsigned char) *p) * 16777619u;
+    worker_t *w = &workers[h % n_workers];
+
+    /* Not even hangups are watched, as they would come again and again */
+#ifdef __linux__
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+#endif
+    c->want_in = c->want_out = false;
+    c->held = false;
+    c->busy = true;
+    c->job = *req;
+    c->job_end = end;
+    c->next_job = -1;
+
+    pthread_mutex_lock(&pool_lock);
+    int i = c - conns;
+    if (w->last >= 0)
+        conns[w->last].next_job = i;
+    else
+        w->first = i;
+    w->last = i;
+    pthread_cond_broadcast(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+    return true;
+}
+
+/* Answer the complete requests in the input of c, until too much of the
+ * responses is unsent, or one of them is handed to a worker
+ */
+static void answer_requests(web_conn_t *c)
+{
+    size_t used = 0;
+    while (!c->closing && !done_fn() &&
+           c->out_len - c->out_sent <= MAX_PENDING) {
+        http_request_t req;
+        ssize_t n = parse_request(c->in + used, c->in_len - used,
+                                  &c->scanned, &req);
+        if (n < 0)
+            error_response(c, c->in_len - used > MAX_REQUEST
+                                  ? "413 Payload Too Large"
+                                  : "400 Bad Request");
+        if (n <= 0)
+            break;
+        /* Its words are left in place, along with those answered before */
+        if (dispatch(c, &req, used + n))
+            return;
+        serve_request(c, &req);
+        used += n;
+        c->scanned = 0;
+    }
+    c->held = !c->closing && c->out_len - c->out_sent > MAX_PENDING;
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+    if (c->in)
+        c->in[c->in_len] = '\0';
+}
+
+/* Read what has arrived on c and answer every complete request in it */
+static void read_conn(web_conn_t *c)
+{
+    bool eof = false;
+    for (;;) {
+        if (!reserve(&c->in, &c->in_cap, c->in_len + READ_CHUNK + 1)) {
+            close_conn(c);
+            return;
+        }
+        ssize_t n = read(c->fd, c->in + c->in_len, READ_CHUNK);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            eof = true;
+            break;
+        }
+        c->in_len += n;
+        c->in[c->in_len] = '\0';
+        /* The rest waits in the socket until these requests are answered */
+        if (c->in_len > MAX_REQUEST)
+            break;
+    }
+
+    answer_requests(c);
+    /* Held requests are answered first, the end is read again after them */
+    if (eof && !c->held && !c->busy)
+        c->closing = true;
+    /* The socket may take the backlog at once, then no event would come */
+    while (!c->busy && flush_conn(c) && c->held && c->want_in && !done_fn())
+        answer_requests(c);
+}
+
+/* Take back the connections whose request a worker ran, and go on with the
+ * requests which followed
+ */
+static void finish_jobs(void)
+{
+    char drain[64];
+    while (read(wake_fds[0], drain, sizeof(drain)) > 0)
+        ;
+    pthread_mutex_lock(&pool_lock);
+    int i = finished;
+    finished = -1;
+    pthread_mutex_unlock(&pool_lock);
+
+    while (i >= 0) {
+        web_conn_t *c = &conns[i];
+        i = c->next_job;
+        c->busy = false;
+        memmove(c->in, c->in + c->job_end, c->in_len - c->job_end);
+        c->in_len -= c->job_end;
+        c->in[c->in_len] = '\0';
+        c->scanned = 0;
+        watch(c->fd, c - conns, false, false, EPOLL_CTL_ADD);
+        answer_requests(c);
+        while (!c->busy && flush_conn(c) && c->held && c->want_in &&
+               !done_fn())
+            answer_requests(c);
+    }
+}
+
+/* Wait for events, at most max of them, into tags and events. Return how
+ * many, 0 when waiting was interrupted.
+ */
+static int wait_events(bool watch_stdin, uint32_t *tags, uint32_t *events,
+                       int max)
+{
+#ifdef __linux__
+    static bool stdin_watched = false;
+    if (watch_stdin != stdin_watched) {
+        struct epoll_event ev = {.events = EPOLLIN, .data.u32 = TAG_STDIN};
+        if (epoll_ctl(epoll_fd, watch_stdin ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                      STDIN_FILENO, &ev) < 0 &&
+            watch_stdin) {
+            /* Files cannot be watched, as they are always readable */
+            tags[0] = TAG_STDIN;
+            events[0] = EPOLLIN;
+            return 1;
+        }
+        stdin_watched = watch_stdin;
+    }
+
+    struct epoll_event evs[64];
+    int n = epoll_wait(epoll_fd, evs, max < 64 ? max : 64, -1);
+    for (int i = 0; i < n; i++) {
+        tags[i] = evs[i].data.u32;
+        events[i] = evs[i].events;
+    }
+    return n < 0 ? 0 : n;
+#else
+    struct pollfd fds[MAX_CONNS + 2];
+    uint32_t fd_tags[MAX_CONNS + 2];
+    int nfds = 0;
+    fds[nfds] = (struct pollfd){.fd = server_fd, .events = POLLIN};
+    fd_tags[nfds++] = TAG_LISTEN;
+    if (watch_stdin) {
+        fds[nfds] = (struct pollfd){.fd = STDIN_FILENO, .events = POLLIN};
+        fd_tags[nfds++] = TAG_STDIN;
+    }
+    for (int i = 0; i < MAX_CONNS; i++) {
+        if (conns[i].fd < 0)
+            continue;
+        fds[nfds] = (struct pollfd){
+            .fd = conns[i].fd,
+            .events = (conns[i].want_in ? POLLIN : 0) |
+                      (conns[i].want_out ? POLLOUT : 0),
+        };
+        fd_tags[nfds++] = i;
+    }
+    if (poll(fds, nfds, -1) <= 0)
+        return 0;
+    int n = 0;
+    for (int i = 0; i < nfds && n < max; i++) {
+        if (!fds[i].revents)
+            continue;
+        tags[n] = fd_tags[i];
+        events[n++] = fds[i].revents & (POLLOUT | POLLIN | POLLHUP | POLLERR);
+    }
+    return n;
+#endif
+}
+
+/* Serve clients until stdin has input, if watch_stdin, or the console quits.
+ * Return true in the latter case.
+ */
+static bool serve(bool watch_stdin)
+{
+    uint32_t tags[64], events[64];
+    while (!done_fn()) {
+        int n = wait_events(watch_stdin, tags, events, 64);
+        bool stdin_ready = false;
+        for (int i = 0; i < n && !done_fn(); i++) {
+            if (tags[i] == TAG_STDIN) {
+                stdin_ready = true;
+            } else if (tags[i] == TAG_LISTEN) {
+                accept_conns();
+            } else if (tags[i] == TAG_WAKE) {
+                finish_jobs();
+            } else if (conns[tags[i]].fd >= 0 && !conns[tags[i]].busy) {
+                web_conn_t *c = &conns[tags[i]];
+                if (events[i] & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    read_conn(c);
+                } else if ((events[i] & EPOLLOUT) && flush_conn(c) &&
+                           c->held && c->want_in) {
+                    /* Requests which waited for the output to drain */
+                    read_conn(c);
+                }
+            }
+        }
+        if (stdin_ready && !done_fn())
+            return false;
+    }
+
+    /* Deliver the responses still queued, the last one to the quit, once
+     * the workers are done with theirs
+     */
+    web_pause();
+    for (int i = 0; i < MAX_CONNS; i++) {
+        web_conn_t *c = &conns[i];
+        if (c->fd < 0)
+            continue;
+        if (c->out_len > c->out_sent) {
+            int flags = fcntl(c->fd, F_GETFL, 0);
+            fcntl(c->fd, F_SETFL, flags & ~O_NONBLOCK);
+            writen(c->fd, c->out + c->out_sent, c->out_len - c->out_sent);
+        }
+        close_conn(c);
+    }
+    return true;
+}
+
+int web_eventmux(char *buf)
+{
+    if (server_fd < 0)
+        return 0;
+    if (!serve(true))
+        return 0;
+    /* Hand back an empty line, after which the console sees that it quit */
+    if (buf)
+        buf[0] = '\0';
+    return 1;
+}
+
+void web_serve(void)
+{
+    if (server_fd >= 0)
+        serve(false);
 }
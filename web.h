@@ -2,13 +2,73 @@
 #define TINYWEB_H
 
 #include <netinet/in.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Run a command line of len bytes for a client, return whether it
+ * succeeded
+ */
+typedef bool (*web_cmd_func_t)(const char *line, size_t len);
 
 int web_open(int port);
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr);
+/* Set how commands are run, how to tell that the console quit, and how to
+ * get the size of the queue, if size is not NULL
+ */
+void web_set_cmd(web_cmd_func_t run, bool (*done)(void), int (*size)(void));
+
+/* Longest session id a client may give, in the session parameter of the URL
+ * or the session cookie
+ */
+#define WEB_SESSION_LEN 32
+
+/* Set function called with the session of each request before its commands
+ * run, and with NULL after them, to go back to the state of the thread
+ */
+void web_set_session(bool (*enter)(const char *id));
+
+/* Most worker threads, see web_set_workers */
+#define WEB_MAX_WORKERS 64
+
+/* Run the requests which name a session on n worker threads, so that
+ * sessions are served in parallel. A session always goes to the same worker,
+ * and its requests run there in order. Session "" and the metrics stay with
+ * the thread serving clients, which is the console's. Each worker calls stop
+ * as it ends, which returns false if the worker could not clean up after its
+ * commands. Return false if the workers cannot be started, which they never
+ * are but on Linux.
+ */
+bool web_set_workers(int n, bool (*stop)(void));
 
-void web_send(int out_fd, char *buffer);
+/* Stop the workers and wait for them, dropping the requests they have not
+ * started. Return false if one of them could not clean up.
+ */
+bool web_stop_workers(void);
 
+/* Whether the calling thread is a web worker */
+bool web_worker(void);
+
+/* Keep the workers from running requests, once those they run are done,
+ * until a matching call to web_resume. For commands which work on the state
+ * of the whole program.
+ */
+void web_pause(void);
+void web_resume(void);
+
+/* Whether output is captured for a client, while a command of it runs */
+bool web_capturing(void);
+
+/* Add output to the response of the client whose command is running */
+void web_vprintf(const char *fmt, va_list ap);
+void web_printf(const char *fmt, ...);
+
+/* Serve clients until standard input has something to read, then return 0.
+ * Return 1 with an empty line in buf once the console quit.
+ */
 int web_eventmux(char *buf);
 
+/* Serve clients until the console quits */
+void web_serve(void);
+
 #endif